@@ -34,11 +34,12 @@ SOURCES += main.cpp \
     fixes/siegetowerfix.cpp \
     fixes/cuttingfix.cpp \
     fixes/tricklebuildingfix.cpp \
-    wkconverter.cpp
+    wkconverter.cpp \
+    assetindex.cpp
 
 win32: LIBS += -L$$PWD/lib/ -llibgenieutils.dll
 LIBS += -L$$PWD/lib/ -lsteam_api
-LIBS += -LD:/boost_1_63_0/stage/lib -lboost_system-mgw53-mt-1_63 -lboost_filesystem-mgw53-mt-1_63
+LIBS += -LD:/boost_1_63_0/stage/lib -lboost_system-mgw53-mt-1_63 -lboost_filesystem-mgw53-mt-1_63 -lboost_iostreams-mgw53-mt-1_63
 INCLUDEPATH += C:\GnuWin32\src\zlib-1.2.3
 LIBS += -LC:\GnuWin32\src\zlib-1.2.3 -lz
 INCLUDEPATH += C:\quazip-0.7.3\quazip
@@ -59,6 +60,9 @@ HEADERS += \
     paths.h\
     conversions.h\
     include/wololo/Drs.h \
+    include/wololo/DrsView.h \
+    include/wololo/DrsWriter.h \
+    include/wololo/civUnits.h \
     fixes/portuguesefix.h \
     fixes/demoshipfix.h \
     fixes/berbersutfix.h \
@@ -82,7 +86,8 @@ HEADERS += \
     fixes/tricklebuildingfix.h \
     wkconverter.h \
     wkgui.h \
-    wksettings.h
+    wksettings.h \
+    assetindex.h
 
 DISTFILES += \
     WololoKingdoms.ico
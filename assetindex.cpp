@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include "assetindex.h"
+
+/*
+ * Looking up an id in the sorted part is a binary search, new entries are searched linearly.
+ * Once there are too many of them they are sorted into the rest.
+ */
+static size_t const maxUnsortedAssets = 256;
+
+static bool compareAssetIds(Asset const &asset, int id) {
+    return asset.id < id;
+}
+
+void AssetIndex::add(Asset const &asset) {
+    assets.push_back(asset);
+    if (assets.size() - sortedAssets > maxUnsortedAssets)
+        sort();
+}
+
+void AssetIndex::add(int id, fs::path const &path) {
+    /*
+     * For files that weren't part of a directory scan, this needs to ask the file system for size and date
+     */
+    add({id, path, fs::file_size(path), fs::last_write_time(path), AssetBuffer()});
+}
+
+void AssetIndex::add(int id, AssetBuffer const &buffer) {
+    /*
+     * For content that was generated or transformed in memory, it doesn't need to go through a file first
+     */
+    add({id, fs::path(), buffer->size(), 0, buffer});
+}
+
+void AssetIndex::add(int id, Asset const &asset) {
+    Asset copy = asset;
+    copy.id = id;
+    add(copy);
+}
+
+void AssetIndex::merge(std::vector<Asset> const &newAssets) {
+    assets.insert(assets.end(), newAssets.begin(), newAssets.end());
+    sort();
+}
+
+Asset const *AssetIndex::find(int id) {
+    for (size_t i = assets.size(); i > sortedAssets; i--) {
+        if (assets[i-1].id == id)
+            return &assets[i-1];
+    }
+    std::vector<Asset>::iterator it = std::lower_bound(assets.begin(), assets.begin() + sortedAssets, id, compareAssetIds);
+    if (it != assets.begin() + sortedAssets && it->id == id)
+        return &*it;
+    return nullptr;
+}
+
+Asset const &AssetIndex::at(int id) {
+    Asset const *asset = find(id);
+    if (asset == nullptr)
+        throw std::out_of_range("No file with id "+std::to_string(id));
+    return *asset;
+}
+
+size_t AssetIndex::count(int id) {
+    return find(id) != nullptr ? 1 : 0;
+}
+
+void AssetIndex::erase(int id) {
+    erase(id, id);
+}
+
+void AssetIndex::erase(int firstId, int lastId) {
+    /*
+     * Removes all entries with firstId <= id <= lastId
+     */
+    sort();
+    std::vector<Asset>::iterator first = std::lower_bound(assets.begin(), assets.end(), firstId, compareAssetIds);
+    std::vector<Asset>::iterator last = std::lower_bound(first, assets.end(), lastId + 1, compareAssetIds);
+    assets.erase(first, last);
+    sortedAssets = assets.size();
+}
+
+void AssetIndex::clear() {
+    assets.clear();
+    sortedAssets = 0;
+}
+
+size_t AssetIndex::size() {
+    sort();
+    return assets.size();
+}
+
+AssetIndex::const_iterator AssetIndex::begin() {
+    sort();
+    return assets.begin();
+}
+
+AssetIndex::const_iterator AssetIndex::end() {
+    sort();
+    return assets.end();
+}
+
+void AssetIndex::sort() {
+    if (sortedAssets == assets.size())
+        return;
+    // stable, so that of several entries with the same id the one added last ends up last
+    std::stable_sort(assets.begin(), assets.end(), [](Asset const &a, Asset const &b) { return a.id < b.id; });
+    size_t unique = 0;
+    for (size_t i = 0; i < assets.size(); i++) {
+        if (unique > 0 && assets[unique-1].id == assets[i].id)
+            assets[unique-1] = std::move(assets[i]);
+        else if (unique != i)
+            assets[unique++] = std::move(assets[i]);
+        else
+            unique++;
+    }
+    assets.resize(unique);
+    sortedAssets = unique;
+}
@@ -0,0 +1,54 @@
+#ifndef ASSETINDEX_H
+#define ASSETINDEX_H
+
+#include <boost/filesystem.hpp>
+#include <ctime>
+#include <memory>
+#include <vector>
+
+namespace fs = boost::filesystem;
+
+typedef std::shared_ptr<std::vector<char> const> AssetBuffer;
+
+struct Asset {
+    int id;
+    fs::path path;
+    uintmax_t size;
+    std::time_t modified;
+    AssetBuffer buffer; // content created in memory, used instead of the file at path if set
+};
+
+/*
+ * The slp/wav files that go into a drs, by the id they will have there.
+ * Entries are kept in a flat vector sorted by id. New entries are collected unsorted first and merged
+ * in when needed, an entry added later replaces an earlier one with the same id.
+ */
+class AssetIndex
+{
+
+public:
+    typedef std::vector<Asset>::const_iterator const_iterator;
+
+    void add(Asset const &asset);
+    void add(int id, fs::path const &path);
+    void add(int id, AssetBuffer const &buffer);
+    void add(int id, Asset const &asset);
+    void merge(std::vector<Asset> const &assets);
+    Asset const *find(int id);
+    Asset const &at(int id);
+    size_t count(int id);
+    void erase(int id);
+    void erase(int firstId, int lastId);
+    void clear();
+    size_t size();
+    const_iterator begin();
+    const_iterator end();
+
+private:
+    void sort();
+
+    std::vector<Asset> assets;
+    size_t sortedAssets = 0; // assets before this index are sorted and unique
+};
+
+#endif // ASSETINDEX_H
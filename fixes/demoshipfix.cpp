@@ -1,5 +1,6 @@
 #include "demoshipfix.h"
 #include "wololo/datPatch.h"
+#include "wololo/civUnits.h"
 
 namespace wololo {
 
@@ -14,11 +15,8 @@ void demoshipPatch(genie::DatFile *aocDat) {
     size_t const heavyDemoShipUnitId = 528;
     //size_t const darkAgeTechId = 104;
 
-    for (size_t civIndex = 0; civIndex < aocDat->Civs.size(); civIndex++) {
-        aocDat->Civs[civIndex].Units[demoRaftUnitId].Creatable.HeroMode = 96;
-        aocDat->Civs[civIndex].Units[demoShipUnitId].Creatable.HeroMode = 96;
-        aocDat->Civs[civIndex].Units[heavyDemoShipUnitId].Creatable.HeroMode = 96;
-    }
+    setUnitField(aocDat, &genie::Unit::Creatable, &genie::unit::Creatable::HeroMode,
+                 {demoRaftUnitId, demoShipUnitId, heavyDemoShipUnitId}, 96);
     /*genie::TechageEffect effect = genie::TechageEffect();
 	effect.Type = 0; // set attribute
 	effect.A = demoShipUnitId;
@@ -1,5 +1,6 @@
 #include "disablenonworkingunits.h"
 #include "wololo/datPatch.h"
+#include "wololo/civUnits.h"
 
 namespace wololo {
 
@@ -8,16 +9,8 @@ void disableNonWorkingUnitsPatch(genie::DatFile *aocDat) {
 	 * Disabling units that are not supposed to show in the scenario editor
 	 */
 
-	for (size_t civIndex = 0; civIndex < aocDat->Civs.size(); civIndex++) {
-		aocDat->Civs[civIndex].Units[1119].HideInEditor = 1;
-		aocDat->Civs[civIndex].Units[1145].HideInEditor = 1;
-		aocDat->Civs[civIndex].Units[1147].HideInEditor = 1;
-		aocDat->Civs[civIndex].Units[1221].HideInEditor = 1;		
-		aocDat->Civs[civIndex].Units[1401].HideInEditor = 1;
-        for (size_t unitIndex = 1224; unitIndex <= 1400; unitIndex++) {
-			aocDat->Civs[civIndex].Units[unitIndex].HideInEditor = 1;
-		}
-	}
+	setUnitField(aocDat, &genie::Unit::HideInEditor, {1119, 1145, 1147, 1221, 1401}, 1);
+	setUnitField(aocDat, &genie::Unit::HideInEditor, 1224, 1400, 1);
 
 }
 
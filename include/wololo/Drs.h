@@ -28,6 +28,11 @@ struct DrsFileInfo {
 	int32_t file_size;
 };
 
-#endif // DRS_H
+// These are copied into the drs as they are, so they must not contain any padding
+static_assert(sizeof (DrsHeader) == 64, "DrsHeader must match the on-disk layout");
+static_assert(sizeof (DrsTableInfo) == 12, "DrsTableInfo must match the on-disk layout");
+static_assert(sizeof (DrsFileInfo) == 12, "DrsFileInfo must match the on-disk layout");
 
 }
+
+#endif // DRS_H
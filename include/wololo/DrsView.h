@@ -0,0 +1,160 @@
+#ifndef DRSVIEW_H
+#define DRSVIEW_H
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include "wololo/Drs.h"
+
+namespace wololo {
+
+/*
+ * Read-only view of a drs file. The directory is copied out of the file up front, payloads are mapped
+ * one at a time when they are asked for and handed out as a span into that mapping, without copying them.
+ * Only the pages of a payload are mapped, so a large drs never has to fit into address space.
+ * The file infos of each table are kept in the order they are listed in the file, next to an index
+ * sorted by id, so looking up an id is a binary search.
+ * Every payload gets a mapping of its own, so several threads can read from one view at the same time.
+ */
+class DrsView {
+
+public:
+	/*
+	 * A payload mapped read-only. data() stays valid as long as this object or a copy of it exists.
+	 */
+	class Payload {
+
+	public:
+		char const *data() const { return length == 0 ? nullptr : window.data() + start; }
+		size_t size() const { return length; }
+
+	private:
+		friend class DrsView;
+		boost::iostreams::mapped_file_source window;
+		size_t start = 0; // where the payload begins inside the window
+		size_t length = 0;
+	};
+
+	explicit DrsView(boost::filesystem::path const &path) : drsPath(path.string()) {
+		/*
+		 * Throws std::runtime_error if the directory doesn't fit into the file.
+		 * Payloads are only checked when they are accessed.
+		 */
+		if (!boost::filesystem::is_regular_file(path))
+			throw std::runtime_error("Can't open drs file: "+path.string());
+		drsSize = boost::filesystem::file_size(path);
+		if (drsSize < sizeof (DrsHeader))
+			throw std::runtime_error("Not a drs file: "+path.string());
+		read(0, reinterpret_cast<char *>(&drsHeader), sizeof (DrsHeader));
+		if (drsHeader.table_count < 0 || sizeof (DrsHeader) + sizeof (DrsTableInfo) * (uintmax_t) drsHeader.table_count > drsSize)
+			throw std::runtime_error("Broken drs table list: "+path.string());
+		tableInfos.resize(drsHeader.table_count);
+		read(sizeof (DrsHeader), reinterpret_cast<char *>(tableInfos.data()), sizeof (DrsTableInfo) * tableInfos.size());
+		fileInfos.resize(tableInfos.size());
+		byId.resize(tableInfos.size());
+		for (size_t i = 0; i < tableInfos.size(); i++) {
+			DrsTableInfo const &table = tableInfos[i];
+			if (table.file_info_offset < 0 || table.num_files < 0
+					|| (uintmax_t) table.file_info_offset + sizeof (DrsFileInfo) * (uintmax_t) table.num_files > drsSize)
+				throw std::runtime_error("Broken drs file list: "+path.string());
+			fileInfos[i].resize(table.num_files);
+			read(table.file_info_offset, reinterpret_cast<char *>(fileInfos[i].data()), sizeof (DrsFileInfo) * fileInfos[i].size());
+			std::vector<DrsFileInfo> const &files = fileInfos[i];
+			for (size_t j = 0; j < files.size(); j++)
+				byId[i].push_back(j);
+			std::stable_sort(byId[i].begin(), byId[i].end(), [&files](size_t a, size_t b) {
+				return files[a].file_id < files[b].file_id;
+			});
+		}
+	}
+
+	DrsHeader const &header() const { return drsHeader; }
+	size_t tableCount() const { return tableInfos.size(); }
+	DrsTableInfo const &table(size_t table) const { return tableInfos.at(table); }
+	std::vector<DrsFileInfo> const &files(size_t table) const { return fileInfos.at(table); }
+	uintmax_t size() const { return drsSize; }
+
+	int findTable(std::string const &extension) const {
+		/*
+		 * Returns the index of the table for files with the given extension (e.g. "slp"), -1 if there is none.
+		 * The extension is stored in reverse in the drs.
+		 */
+		std::string reversed(extension.rbegin(), extension.rend());
+		for (size_t i = 0; i < tableInfos.size(); i++) {
+			if (std::string(tableInfos[i].file_extension, 3) == reversed)
+				return i;
+		}
+		return -1;
+	}
+
+	DrsFileInfo const *find(size_t table, int32_t id) const {
+		/*
+		 * Returns the file info with this id, nullptr if the table has none.
+		 * If an id is listed several times, this is the first one in the file.
+		 */
+		std::vector<DrsFileInfo> const &files = fileInfos.at(table);
+		std::vector<size_t>::const_iterator it = std::lower_bound(byId[table].begin(), byId[table].end(), id,
+				[&files](size_t file, int32_t id) { return files[file].file_id < id; });
+		if (it == byId[table].end() || files[*it].file_id != id)
+			return nullptr;
+		return &files[*it];
+	}
+
+	bool contains(DrsFileInfo const &info) const {
+		return info.file_data_offset >= 0 && info.file_size >= 0
+				&& (uintmax_t) info.file_data_offset + (uintmax_t) info.file_size <= drsSize;
+	}
+
+	Payload payload(DrsFileInfo const &info) const {
+		if (!contains(info))
+			throw std::out_of_range("drs entry "+std::to_string(info.file_id)+" is outside of the file");
+		return map(info.file_data_offset, info.file_size);
+	}
+
+	Payload payload(size_t table, int32_t id) const {
+		DrsFileInfo const *info = find(table, id);
+		if (info == nullptr)
+			throw std::out_of_range("No drs entry "+std::to_string(id));
+		return payload(*info);
+	}
+
+private:
+	Payload map(uintmax_t offset, size_t size) const {
+		/*
+		 * Maps the pages holding size bytes at offset, a mapping has to start at a multiple of the allocation granularity
+		 */
+		Payload mapped;
+		mapped.length = size;
+		if (size == 0)
+			return mapped; // an empty range can't be mapped
+		uintmax_t windowStart = offset - offset % boost::iostreams::mapped_file::alignment();
+		boost::iostreams::mapped_file_params params(drsPath);
+		params.offset = windowStart;
+		params.length = offset - windowStart + size;
+		mapped.window.open(params);
+		mapped.start = offset - windowStart;
+		return mapped;
+	}
+
+	void read(uintmax_t offset, char *data, size_t size) const {
+		if (size == 0)
+			return;
+		Payload const block = map(offset, size);
+		std::memcpy(data, block.data(), size);
+	}
+
+	std::string drsPath;
+	uintmax_t drsSize;
+	DrsHeader drsHeader;
+	std::vector<DrsTableInfo> tableInfos;
+	std::vector<std::vector<DrsFileInfo>> fileInfos; // in the order of the file
+	std::vector<std::vector<size_t>> byId; // indices into fileInfos, sorted by id
+};
+
+}
+
+#endif // DRSVIEW_H
@@ -0,0 +1,200 @@
+#ifndef DRSWRITER_H
+#define DRSWRITER_H
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include "wololo/Drs.h"
+
+namespace wololo {
+
+/*
+ * Where the bytes of a drs end up. Payloads may be written by several threads at once,
+ * each one to its own range, so write must be safe for that without serializing the writes.
+ */
+class DrsSink {
+
+public:
+	virtual ~DrsSink() {}
+	virtual void write(uintmax_t offset, char const *data, size_t size) = 0;
+};
+
+/*
+ * Sink for a drs file on disk that already has its final size. Every write maps only the range it goes to
+ * and copies the data into it, so nothing maps the whole drs (a 32 bit build may not have the address space
+ * for that next to the dats) and no stream sits between the data and the file.
+ * Writes share no state, each one is a positional write of its own, so threads can write at the same time.
+ */
+class FileDrsSink : public DrsSink {
+
+public:
+	explicit FileDrsSink(std::string const &path) : path(path) {}
+
+	void write(uintmax_t offset, char const *data, size_t size) override {
+		if (size == 0)
+			return; // an empty range can't be mapped
+		// a mapping has to start at a multiple of the allocation granularity
+		uintmax_t windowStart = offset - offset % boost::iostreams::mapped_file::alignment();
+		boost::iostreams::mapped_file_params params(path);
+		params.flags = boost::iostreams::mapped_file::readwrite;
+		params.offset = windowStart;
+		params.length = offset - windowStart + size;
+		boost::iostreams::mapped_file window(params);
+		std::memcpy(window.data() + (offset - windowStart), data, size);
+	}
+
+private:
+	std::string path;
+};
+
+/*
+ * Lays out a drs with any number of tables. Files are added to their tables first, either with a payload
+ * still to be placed, sharing the payload of an earlier file, or with a payload that is already in the file
+ * (when editing an existing drs). layout() then gives every file its offset, and the header, table infos
+ * and file infos are written to the sink as one block. The payloads themselves are up to the caller.
+ */
+class DrsWriter {
+
+public:
+	DrsWriter() {
+		DrsHeader const defaultHeader = {
+			{ 'C', 'o', 'p', 'y', 'r',
+			  'i', 'g', 'h', 't', ' ',
+			  '(', 'c', ')', ' ', '1',
+			  '9', '9', '7', ' ', 'E',
+			  'n', 's', 'e', 'm', 'b',
+			  'l', 'e', ' ', 'S', 't',
+			  'u', 'd', 'i', 'o', 's',
+			  '.', '\x1a' }, // copyright
+			{ '1', '.', '0', '0' }, // version
+			{ 't', 'r', 'i', 'b', 'e' }, // ftype
+			0, // table_count, set when writing
+			0 // file_offset, set when writing
+		};
+		header = defaultHeader;
+	}
+
+	explicit DrsWriter(DrsHeader const &header) : header(header) {}
+
+	size_t addTable(std::string const &extension, uint8_t fileType = 0x20) {
+		/*
+		 * extension is the usual one, e.g. "slp". It's stored in reverse in the drs.
+		 */
+		DrsTableInfo table = {fileType, {0, 0, 0}, 0, 0};
+		std::string reversed(extension.rbegin(), extension.rend());
+		std::memcpy(table.file_extension, reversed.data(), std::min<size_t>(reversed.size(), 3));
+		return addTable(table);
+	}
+
+	size_t addTable(DrsTableInfo const &table) {
+		tables.push_back(table);
+		return tables.size() - 1;
+	}
+
+	size_t addFile(size_t table, int32_t id, int32_t size) {
+		DrsFileInfo info = {id, 0, size};
+		return addEntry(table, info, Unplaced, 0);
+	}
+
+	size_t addSharedFile(size_t table, int32_t id, size_t sharedWith) {
+		if (sharedWith >= files.size())
+			throw std::out_of_range("A drs file can only share the payload of an earlier one");
+		DrsFileInfo info = {id, 0, files[sharedWith].info.file_size};
+		return addEntry(table, info, Shared, sharedWith);
+	}
+
+	size_t addPlacedFile(size_t table, DrsFileInfo const &info) {
+		return addEntry(table, info, Placed, 0);
+	}
+
+	size_t fileCount() const { return files.size(); }
+	size_t tableCount() const { return tables.size(); }
+	DrsFileInfo &file(size_t file) { return files.at(file).info; }
+	DrsFileInfo const &file(size_t file) const { return files.at(file).info; }
+	size_t tableOf(size_t file) const { return files.at(file).table; }
+	bool placed(size_t file) const { return files.at(file).placement == Placed; }
+
+	int32_t directorySize() const {
+		return sizeof (DrsHeader) + sizeof (DrsTableInfo) * tables.size() + sizeof (DrsFileInfo) * files.size();
+	}
+
+	uintmax_t layout(uintmax_t dataStart = 0) {
+		/*
+		 * Gives the files that aren't placed yet consecutive offsets in the order they were added,
+		 * starting after the directory or at dataStart, whatever is later. Returns the end of the last one.
+		 */
+		uintmax_t offset = std::max<uintmax_t>(directorySize(), dataStart);
+		for (std::vector<Entry>::iterator it = files.begin(); it != files.end(); it++) {
+			if (it->placement == Unplaced) {
+				it->info.file_data_offset = offset;
+				offset += it->info.file_size;
+			} else if (it->placement == Shared) {
+				it->info.file_data_offset = files[it->sharedWith].info.file_data_offset;
+			}
+		}
+		return offset;
+	}
+
+	std::vector<char> directory() const {
+		/*
+		 * Header, table infos and file infos, as they are at the start of the drs
+		 */
+		std::vector<char> directory(directorySize());
+		DrsHeader drsHeader = header;
+		drsHeader.table_count = tables.size();
+		drsHeader.file_offset = directorySize();
+		std::memcpy(directory.data(), &drsHeader, sizeof (DrsHeader));
+		char *fileInfos = directory.data() + sizeof (DrsHeader) + sizeof (DrsTableInfo) * tables.size();
+		for (size_t i = 0; i < tables.size(); i++) {
+			DrsTableInfo table = tables[i];
+			table.file_info_offset = fileInfos - directory.data();
+			table.num_files = 0;
+			for (std::vector<Entry>::const_iterator it = files.begin(); it != files.end(); it++) {
+				if (it->table != i)
+					continue;
+				std::memcpy(fileInfos, &it->info, sizeof (DrsFileInfo));
+				fileInfos += sizeof (DrsFileInfo);
+				table.num_files++;
+			}
+			std::memcpy(directory.data() + sizeof (DrsHeader) + sizeof (DrsTableInfo) * i, &table, sizeof (DrsTableInfo));
+		}
+		return directory;
+	}
+
+	void writeDirectory(DrsSink &sink) const {
+		std::vector<char> const block = directory();
+		sink.write(0, block.data(), block.size());
+	}
+
+private:
+	enum Placement {
+		Unplaced,
+		Shared,
+		Placed
+	};
+
+	struct Entry {
+		size_t table;
+		DrsFileInfo info;
+		Placement placement;
+		size_t sharedWith;
+	};
+
+	size_t addEntry(size_t table, DrsFileInfo const &info, Placement placement, size_t sharedWith) {
+		if (table >= tables.size())
+			throw std::out_of_range("No drs table "+std::to_string(table));
+		files.push_back({table, info, placement, sharedWith});
+		return files.size() - 1;
+	}
+
+	DrsHeader header;
+	std::vector<DrsTableInfo> tables;
+	std::vector<Entry> files;
+};
+
+}
+
+#endif // DRSWRITER_H
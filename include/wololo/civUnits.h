@@ -0,0 +1,56 @@
+#ifndef CIVUNITS_H
+#define CIVUNITS_H
+
+#include <initializer_list>
+#include <vector>
+#include "genie/dat/DatFile.h"
+
+namespace wololo {
+
+/*
+ * Setting one field of some units in every civ. Every civ has its own copy of all units,
+ * so a patch that changes a field for a few units has to repeat that for each civ.
+ * The field is passed as a member pointer, e.g.
+ * setUnitField(aocDat, &genie::Unit::HideInEditor, 1224, 1400, 1);
+ * setUnitField(aocDat, &genie::Unit::Creatable, &genie::unit::Creatable::HeroMode, {527, 528}, 96);
+ */
+
+template <typename Field, typename Value>
+void setUnitField(genie::DatFile *dat, Field genie::Unit::*field, size_t firstUnitId, size_t lastUnitId, Value const &value) {
+	/*
+	 * Sets field to value for the units firstUnitId to lastUnitId (inclusive) of every civ
+	 */
+	for (std::vector<genie::Civ>::iterator civ = dat->Civs.begin(); civ != dat->Civs.end(); civ++) {
+		for (size_t unitId = firstUnitId; unitId <= lastUnitId; unitId++) {
+			civ->Units[unitId].*field = value;
+		}
+	}
+}
+
+template <typename Field, typename Value>
+void setUnitField(genie::DatFile *dat, Field genie::Unit::*field, std::initializer_list<size_t> unitIds, Value const &value) {
+	/*
+	 * Sets field to value for the units with these ids in every civ
+	 */
+	for (std::vector<genie::Civ>::iterator civ = dat->Civs.begin(); civ != dat->Civs.end(); civ++) {
+		for (std::initializer_list<size_t>::const_iterator unitId = unitIds.begin(); unitId != unitIds.end(); unitId++) {
+			civ->Units[*unitId].*field = value;
+		}
+	}
+}
+
+template <typename Part, typename Field, typename Value>
+void setUnitField(genie::DatFile *dat, Part genie::Unit::*part, Field Part::*field, std::initializer_list<size_t> unitIds, Value const &value) {
+	/*
+	 * Same for a field of one of the unit's parts (Creatable, Bird, Type50, ...)
+	 */
+	for (std::vector<genie::Civ>::iterator civ = dat->Civs.begin(); civ != dat->Civs.end(); civ++) {
+		for (std::initializer_list<size_t>::const_iterator unitId = unitIds.begin(); unitId != unitIds.end(); unitId++) {
+			(civ->Units[*unitId].*part).*field = value;
+		}
+	}
+}
+
+}
+
+#endif // CIVUNITS_H
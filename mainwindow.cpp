@@ -179,6 +179,10 @@ void MainWindow::runConverter() {
         this->ui->replaceTooltips->isChecked(), this->ui->useGrid->isChecked(), installDir, language, dlcLevel,
         this->ui->usePatch->isChecked() ? this->ui->patchSelection->currentIndex() : -1, this->ui->hotkeyChoice->currentIndex(),
         HDPath, outPath, vooblyDir, upDir, dataModList, modName);
+    QSettings userSettings("Jineapple", "WololoKingdoms Installer");
+    settings->drsWorkers = userSettings.value("drsWorkers", 0).toUInt(); //Not in the UI, for tuning on slow or network drives
+    settings->verifyDrs = userSettings.value("verifyDrs", true).toBool();
+    settings->compactDrs = userSettings.value("compactDrs", false).toBool();
     QThread* thread = new QThread;
     WKConverter* converter = new WKConverter(settings);
     converter->moveToThread(thread);
@@ -3,14 +3,21 @@
 #include <map>
 #include <algorithm>
 #include <cctype>
+#include <cstring>
 #include <string>
 #include <sstream>
 #include <windows.h>
 #include <shellapi.h>
 
+#include <atomic>
 #include <chrono>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/algorithm/string/replace.hpp>
 #include "genie/dat/DatFile.h"
 #include "genie/lang/LangFile.h"
@@ -18,6 +25,8 @@
 #include "conversions.h"
 #include "wololo/datPatch.h"
 #include "wololo/Drs.h"
+#include "wololo/DrsView.h"
+#include "wololo/DrsWriter.h"
 #include "fixes/berbersutfix.h"
 #include "fixes/vietfix.h"
 #include "fixes/demoshipfix.h"
@@ -36,6 +45,10 @@
 #include "fixes/tricklebuildingfix.h"
 
 #include <QCryptographicHash>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
 #include "sdk/public/steam/steam_api.h"
 
 #include "JlCompress.h"
@@ -128,41 +141,71 @@ void WKConverter::loadGameStrings(std::map<int,std::string>& langReplacement) {
 
 void WKConverter::indexDrsFiles(fs::path const &src, bool expansionFiles, bool terrainFiles) {
     /*
-     * Index files to be written into the drs into a map, with the ID the file will have later
-     * being the key, and the path it should be copied from being the value
+     * Index files to be written into the drs, with the ID the file will have later as the key.
+     * If the directory was already handed to prefetchDrsFiles, this waits for that scan, otherwise
+     * it's scanned now. Either way the result is only merged here, so the order of the
+     * indexDrsFiles calls decides which files override others, wherever the scans ran.
      * Parameters:
      * src: The directory to iterate through. All .slp and .wav files in this directory will be indexed
-     * expansionFiles: If false, files are written to a seperate map. They are not written to the drs later,
+     * expansionFiles: If false, files are written to a seperate index. They are not written to the drs later,
      *                  but we need them for comparison purposes in the independent architecture patching.
      * terrainFiles: If true, these are terrain files, written to a seperate map, as we need them for
      *                  expansion map creation.
      */
-	if (fs::is_directory(src)) {
-		for (fs::directory_iterator current(src), end;current != end; ++current) {
-			fs::path currentPath(current->path());
-            indexDrsFiles(currentPath, expansionFiles, terrainFiles);
-		}
-	}
-	else {
-		std::string extension = src.extension().string();
+    DrsFileScan scan;
+    std::map<fs::path, std::future<DrsFileScan>>::iterator pending = drsFileScans.find(src);
+    if (pending != drsFileScans.end()) {
+        scan = pending->second.get();
+        drsFileScans.erase(pending);
+    } else {
+        scan = scanDrsFiles(src, terrainFiles);
+    }
+    for (std::map<std::string,fs::path>::iterator it = scan.terrains.begin(); it != scan.terrains.end(); it++)
+        newTerrainFiles[it->first] = it->second;
+    if (!expansionFiles)
+        aocSlpFiles.merge(scan.slps);
+    else
+        slpFiles.merge(scan.slps);
+    wavFiles.merge(scan.wavs);
+}
+
+void WKConverter::prefetchDrsFiles(fs::path const &src, bool terrainFiles) {
+    /*
+     * Starts scanning a directory on its own thread, to be picked up by indexDrsFiles later.
+     * The directory walks are independent of each other, on a cold disk cache they can overlap.
+     */
+    if (drsFileScans.count(src))
+        return;
+    drsFileScans[src] = std::async(std::launch::async, &WKConverter::scanDrsFiles, src, terrainFiles);
+}
+
+WKConverter::DrsFileScan WKConverter::scanDrsFiles(fs::path const &src, bool terrainFiles) {
+    /*
+     * Reads a directory once: size and date of each file come with the directory listing
+     * and are kept, so nothing needs to ask the file system about these files again.
+     * This doesn't touch the converter, it may run on any thread.
+     */
+    DrsFileScan scan;
+    QDirIterator current(QString::fromStdWString(src.wstring()), QDir::Files | QDir::Hidden | QDir::System, QDirIterator::Subdirectories | QDirIterator::FollowSymlinks);
+    while (current.hasNext()) {
+        current.next();
+        QFileInfo fileInfo = current.fileInfo();
+        fs::path currentPath(fileInfo.filePath().toStdWString());
+        std::string extension = currentPath.extension().string();
         if(terrainFiles) {
             if (extension == ".slp") {
-                newTerrainFiles[src.filename().string()] = src;
-            }
-        } else {
-            if (extension == ".slp") {
-                int id = atoi(src.stem().string().c_str());
-                if (!expansionFiles)
-                    aocSlpFiles.insert(id);
-                else
-                    slpFiles[id] = src;
-            }
-            else if (extension == ".wav") {
-                int id = atoi(src.stem().string().c_str());
-                wavFiles[id] = src;
+                scan.terrains[currentPath.filename().string()] = currentPath;
             }
+        } else if (extension == ".slp" || extension == ".wav") {
+            Asset asset = {atoi(currentPath.stem().string().c_str()), currentPath, (uintmax_t) fileInfo.size(),
+                           (std::time_t) fileInfo.lastModified().toTime_t(), AssetBuffer()};
+            if (extension == ".wav")
+                scan.wavs.push_back(asset);
+            else
+                scan.slps.push_back(asset);
         }
-	}
+    }
+    return scan;
 }
 
 void WKConverter::copyHistoryFiles(fs::path inputDir, fs::path outputDir) {
@@ -557,7 +600,7 @@ void WKConverter::convertLanguageFile(std::ifstream *in, std::ofstream *iniOut,
     iniOut->close();
 }
 
-void WKConverter::makeDrs(std::ofstream *out) {
+void WKConverter::makeDrs(fs::path const &drsOutPath) {
 
     emit setInfo("working$\n$workingDrs");
 
@@ -572,328 +615,571 @@ void WKConverter::makeDrs(std::ofstream *out) {
 	 * Some of the interface files are duplicates because of the shifting,
 	 * get rid of those
 	 */
-	std::map<int,fs::path>::iterator start;
-	std::map<int,fs::path>::iterator end;
-	start = slpFiles.find(51132);
-	end = std::next(start,8);
-	slpFiles.erase(start,end);
-	start = slpFiles.find(51172);
-	end = std::next(start,8);
-	slpFiles.erase(start,end);
-
-	const int numberOfTables = 2; // slp and wav
-	int numberOfSlpFiles = slpFiles.size();
-	int numberOfWavFiles = wavFiles.size();
-	int offsetOfFirstFile = sizeof (wololo::DrsHeader) +
-			sizeof (wololo::DrsTableInfo) * numberOfTables +
-			sizeof (wololo::DrsFileInfo) * (numberOfSlpFiles + numberOfWavFiles);
-	int offset = offsetOfFirstFile;
-
-
-	// file infos
-
-	std::vector<wololo::DrsFileInfo> slpFileInfos;
-	std::vector<wololo::DrsFileInfo> wavFileInfos;
-
-	for (std::map<int,fs::path>::iterator it = slpFiles.begin(); it != slpFiles.end(); it++) {
-		wololo::DrsFileInfo slp;
-		size_t size;
-		size = fs::file_size(it->second);
-		slp.file_id = it->first;
-		slp.file_data_offset = offset;
-		slp.file_size = size;
-		offset += size;
-		slpFileInfos.push_back(slp);
-
+	slpFiles.erase(51132,51139);
+	slpFiles.erase(51172,51179);
+
+	if (fs::is_symlink(drsOutPath))
+		fs::remove(drsOutPath); // don't write through a link to the drs of another install
+	DrsManifest manifest;
+	DrsManifest previous;
+	bool hasPrevious = loadDrsManifest(drsOutPath, previous);
+
+	for (AssetIndex::const_iterator it = slpFiles.begin(); it != slpFiles.end(); it++) {
+		wololo::DrsFileInfo slp = {it->id, 0, (int32_t) it->size};
+		manifest.payloads.push_back({0, it->path, it->buffer, slp, it->modified, "", true, false, 0});
 	}
     emit increaseProgress(1); //67
 
-	for (std::map<int,fs::path>::iterator it = wavFiles.begin(); it != wavFiles.end(); it++) {
-		wololo::DrsFileInfo wav;
-		size_t size;
-		size = fs::file_size(it->second);
-		wav.file_id = it->first;
-		wav.file_data_offset = offset;
-		wav.file_size = size;
-		offset += size;
-		wavFileInfos.push_back(wav);
-
+	for (AssetIndex::const_iterator it = wavFiles.begin(); it != wavFiles.end(); it++) {
+		wololo::DrsFileInfo wav = {it->id, 0, (int32_t) it->size};
+		manifest.payloads.push_back({1, it->path, it->buffer, wav, it->modified, "", true, false, 0});
 	}
-    emit increaseProgress(1); //68
-
-	// header infos
-
-	wololo::DrsHeader const header = {
-		{ 'C', 'o', 'p', 'y', 'r',
-		  'i', 'g', 'h', 't', ' ',
-		  '(', 'c', ')', ' ', '1',
-		  '9', '9', '7', ' ', 'E',
-		  'n', 's', 'e', 'm', 'b',
-		  'l', 'e', ' ', 'S', 't',
-		  'u', 'd', 'i', 'o', 's',
-		  '.', '\x1a' }, // copyright
-		{ '1', '.', '0', '0' }, // version
-		{ 't', 'r', 'i', 'b', 'e' }, // ftype
-		numberOfTables, // table_count
-		offsetOfFirstFile // file_offset
-	};
 
-	// table infos
+	/*
+	 * Entries with the same content (e.g. wall or healing slps used for several civ groups)
+	 * all point to a single copy of the data.
+	 */
+	shareDrsPayloads(manifest.payloads, previous);
+    emit increaseProgress(1); //68
 
-	wololo::DrsTableInfo const slpTableInfo = {
-		0x20, // file_type, MAGIC
-		{ 'p', 'l', 's' }, // file_extension, "slp" in reverse
-		sizeof (wololo::DrsHeader) + sizeof (wololo::DrsFileInfo) * numberOfTables, // file_info_offset
-		(int) slpFileInfos.size() // num_files
-	};
-	wololo::DrsTableInfo const wavTableInfo = {
-		0x20, // file_type, MAGIC
-		{ 'v', 'a', 'w' }, // file_extension, "wav" in reverse
-		(int) (sizeof (wololo::DrsHeader) +  sizeof (wololo::DrsFileInfo) * numberOfTables + sizeof (wololo::DrsFileInfo) * slpFileInfos.size()), // file_info_offset
-		(int) wavFileInfos.size() // num_files
-	};
+	wololo::DrsWriter writer;
+	size_t tables[] = {writer.addTable("slp"), writer.addTable("wav")};
+	for (std::vector<DrsPayload>::iterator it = manifest.payloads.begin(); it != manifest.payloads.end(); it++) {
+		if (it->shared)
+			writer.addSharedFile(tables[it->table], it->info.file_id, it->sharedWith);
+		else
+			writer.addFile(tables[it->table], it->info.file_id, it->info.file_size);
+	}
+	uintmax_t drsSize = writer.layout();
+	for (size_t i = 0; i < manifest.payloads.size(); i++)
+		manifest.payloads[i].info = writer.file(i);
     emit increaseProgress(1); //69
 
+	/*
+	 * If the drs was written by an earlier run and nothing changed its layout, only the payloads
+	 * whose content changed since then need to be written again. If there are none, we're done.
+	 */
+	bool patch = hasPrevious && markChangedPayloads(manifest, previous);
+	if (patch && std::none_of(manifest.payloads.begin(), manifest.payloads.end(), [](DrsPayload const &payload) { return payload.dirty; })) {
+		emit log("DRS unchanged");
+		emit increaseProgress(5); //74
+		return;
+	}
+	fs::remove(drsManifestPath(drsOutPath)); // a half written drs must not look up to date
 
     emit setInfo("working$\n$workingDrs2");
 
-	// now write the actual drs file
+	/*
+	 * All offsets are known at this point, so the drs is created at its final size and the directory and
+	 * the payloads are written straight to their place. Nothing maps the whole drs, on a 32 bit build
+	 * there might not be enough address space left for that next to the dats.
+	 * When patching, the existing drs is written to as it is instead.
+	 */
+	if (!patch) {
+		std::ofstream(drsOutPath.string(), std::ios::binary | std::ios::trunc).close();
+		fs::resize_file(drsOutPath, drsSize);
+	}
+	wololo::FileDrsSink sink(drsOutPath.string());
+    emit increaseProgress(1); //70
 
-	// header
-	out->write(header.copyright, sizeof (wololo::DrsHeader::copyright));
-	out->write(header.version, sizeof (wololo::DrsHeader::version));
-	out->write(header.ftype, sizeof (wololo::DrsHeader::ftype));
-	out->write(reinterpret_cast<const char *>(&header.table_count), sizeof (wololo::DrsHeader::table_count));
-	out->write(reinterpret_cast<const char *>(&header.file_offset), sizeof (wololo::DrsHeader::file_offset));
+	// header, table infos and file infos
+	writer.writeDirectory(sink);
+    emit increaseProgress(2); //72
 
+    emit setInfo("working$\n$workingDrs3");
+    emit increaseProgress(1); //73
 
-	// table infos
-	out->write(reinterpret_cast<const char *>(&slpTableInfo.file_type), sizeof (wololo::DrsTableInfo::file_type));
-	out->write(slpTableInfo.file_extension, sizeof (wololo::DrsTableInfo::file_extension));
-	out->write(reinterpret_cast<const char *>(&slpTableInfo.file_info_offset), sizeof (wololo::DrsTableInfo::file_info_offset));
-	out->write(reinterpret_cast<const char *>(&slpTableInfo.num_files), sizeof (wololo::DrsTableInfo::num_files));
+	// now write the actual files
+	writeDrsPayloads(sink, manifest.payloads);
+    emit increaseProgress(1); //74
+	for (size_t i = 0; i < manifest.payloads.size(); i++) {
+		if (manifest.payloads[i].shared)
+			manifest.payloads[i].hash = manifest.payloads[manifest.payloads[i].sharedWith].hash;
+	}
+	if (settings->verifyDrs)
+		verifyDrs(drsOutPath, manifest.payloads);
+    saveDrsManifest(drsOutPath, manifest);
+}
+
+void WKConverter::writeDrsPayloads(wololo::DrsSink &sink, std::vector<DrsPayload> &payloads) {
+    /*
+     * Every payload already has its final offset, so they can be copied into the drs
+     * in any order and by several threads at once, the result is the same byte for byte.
+     * Parameters:
+     * sink: Where the drs is written to
+     * payloads: The entries of the drs. Only dirty ones are written, their hash is filled in while copying
+     */
+    runDrsWorkers(payloads.size(), [&](size_t i) {
+        if (payloads[i].dirty)
+            payloads[i].hash = copyDrsPayload(payloads[i], sink);
+    });
+}
 
+void WKConverter::runDrsWorkers(size_t count, std::function<void(size_t)> const &work) {
+    /*
+     * Calls work for 0 to count-1 from the drsWorkers threads (one per core by default).
+     * Each worker just takes the next index nobody has started on yet.
+     * The first exception thrown by work stops the others and is rethrown here.
+     */
+    unsigned int workers = settings->drsWorkers > 0 ? settings->drsWorkers : std::thread::hardware_concurrency();
+    workers = std::max(1u, std::min<unsigned int>(workers, count));
+
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    auto worker = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            try {
+                work(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+                next = count; // no point in continuing, the drs is broken anyway
+            }
+        }
+    };
 
-	out->write(reinterpret_cast<const char *>(&wavTableInfo.file_type), sizeof (wololo::DrsTableInfo::file_type));
-	out->write(wavTableInfo.file_extension, sizeof (wololo::DrsTableInfo::file_extension));
-	out->write(reinterpret_cast<const char *>(&wavTableInfo.file_info_offset), sizeof (wololo::DrsTableInfo::file_info_offset));
-	out->write(reinterpret_cast<const char *>(&wavTableInfo.num_files), sizeof (wololo::DrsTableInfo::num_files));
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < workers; i++)
+        threads.push_back(std::thread(worker));
+    worker();
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); it++)
+        it->join();
 
-    emit increaseProgress(1); //70
-	// file infos
-	for (std::vector<wololo::DrsFileInfo>::iterator it = slpFileInfos.begin(); it != slpFileInfos.end(); it++) {
-		out->write(reinterpret_cast<const char *>(&it->file_id), sizeof (wololo::DrsFileInfo::file_id));
-		out->write(reinterpret_cast<const char *>(&it->file_data_offset), sizeof (wololo::DrsFileInfo::file_data_offset));
-		out->write(reinterpret_cast<const char *>(&it->file_size), sizeof (wololo::DrsFileInfo::file_size));
+    if (error)
+        std::rethrow_exception(error);
+}
 
-	}
-    emit increaseProgress(1); //71
-	for (std::vector<wololo::DrsFileInfo>::iterator it = wavFileInfos.begin(); it != wavFileInfos.end(); it++) {
-		out->write(reinterpret_cast<const char *>(&it->file_id), sizeof (wololo::DrsFileInfo::file_id));
-		out->write(reinterpret_cast<const char *>(&it->file_data_offset), sizeof (wololo::DrsFileInfo::file_data_offset));
-		out->write(reinterpret_cast<const char *>(&it->file_size), sizeof (wololo::DrsFileInfo::file_size));
+std::string WKConverter::copyDrsPayload(DrsPayload const &payload, wololo::DrsSink &sink) {
+    /*
+     * Copies a slp/wav file or buffer into its place in the drs and returns the hash of its content.
+     * Payloads that were already hashed while looking for shared content keep that hash.
+     * Empty files can't be mapped, but there's nothing to copy for them anyway.
+     */
+    size_t size = payload.info.file_size;
+    if (payload.buffer) {
+        sink.write(payload.info.file_data_offset, payload.buffer->data(), size);
+        return payload.hash.empty() ? hashDrsPayload(payload.buffer->data(), size) : payload.hash;
+    }
+    if (size == 0)
+        return hashDrsPayload(nullptr, 0);
+    boost::iostreams::mapped_file_source in(payload.source.string());
+    if (in.size() != size)
+        throw std::runtime_error("File changed while writing the drs: "+payload.source.string());
+    sink.write(payload.info.file_data_offset, in.data(), size);
+    return payload.hash.empty() ? hashDrsPayload(in.data(), size) : payload.hash;
+}
 
-	}
-    emit increaseProgress(1); //72
+std::string WKConverter::hashDrsPayload(char const *data, size_t size) {
+    return QCryptographicHash::hash(QByteArray::fromRawData(data, size), QCryptographicHash::Md5).toHex().toStdString();
+}
 
-    emit setInfo("working$\n$workingDrs3");
+std::string WKConverter::hashDrsSource(DrsPayload const &payload) {
+    if (payload.buffer)
+        return hashDrsPayload(payload.buffer->data(), payload.buffer->size());
+    if (fs::file_size(payload.source) == 0)
+        return hashDrsPayload(nullptr, 0);
+    boost::iostreams::mapped_file_source in(payload.source.string());
+    return hashDrsPayload(in.data(), in.size());
+}
 
-	// now write the actual files
-	for (std::map<int,fs::path>::iterator it = slpFiles.begin(); it != slpFiles.end();it++) {
-			std::ifstream srcStream = std::ifstream(it->second.string(), std::ios::binary);
-			*out << srcStream.rdbuf();
-            srcStream.close();
+fs::path WKConverter::drsManifestPath(fs::path const &drsPath) {
+    return fs::path(drsPath.string()+".manifest");
+}
 
-	}
-    emit increaseProgress(1); //73
+bool WKConverter::loadDrsManifest(fs::path const &drsPath, DrsManifest &manifest) {
+    /*
+     * Reads the manifest written next to a drs by an earlier run.
+     * Returns false if there is none, or if the drs has been changed since the manifest was written.
+     * The format is a line "wkdrs1 <drs size> <drs mtime>", a line "base <base drs>"
+     * and then one line per payload: "<table> <id> <offset> <size> <mtime> <hash> <source path>",
+     * with "<memory>" as the source of payloads that came from a buffer
+     */
+    std::ifstream in(drsManifestPath(drsPath).string());
+    std::string line;
+    if (!fs::exists(drsPath) || !std::getline(in, line))
+        return false;
+    std::istringstream header(line);
+    std::string magic;
+    uintmax_t size;
+    std::time_t modified;
+    header >> magic >> size >> modified;
+    if (header.fail() || magic != "wkdrs1" || size != fs::file_size(drsPath) || modified != fs::last_write_time(drsPath))
+        return false;
+    if (!std::getline(in, line) || line.substr(0,5) != "base ")
+        return false;
+    manifest.base = line.substr(5);
+    while (std::getline(in, line)) {
+        std::istringstream entry(line);
+        DrsPayload payload;
+        std::string source;
+        entry >> payload.table >> payload.info.file_id >> payload.info.file_data_offset >> payload.info.file_size
+              >> payload.modified >> payload.hash;
+        std::getline(entry >> std::ws, source);
+        if (entry.fail())
+            return false;
+        payload.source = source;
+        payload.dirty = false;
+        payload.shared = false;
+        manifest.payloads.push_back(payload);
+    }
+    return true;
+}
 
-	for (std::map<int,fs::path>::iterator it = wavFiles.begin(); it != wavFiles.end(); it++) {
-		std::ifstream srcStream = std::ifstream(it->second.string(), std::ios::binary);
-		*out << srcStream.rdbuf();
-        srcStream.close();
+void WKConverter::saveDrsManifest(fs::path const &drsPath, DrsManifest const &manifest) {
+    std::ofstream out(drsManifestPath(drsPath).string());
+    out << "wkdrs1 " << fs::file_size(drsPath) << ' ' << fs::last_write_time(drsPath) << '\n';
+    out << "base " << manifest.base << '\n';
+    for (std::vector<DrsPayload>::const_iterator it = manifest.payloads.begin(); it != manifest.payloads.end(); it++) {
+        out << it->table << ' ' << it->info.file_id << ' ' << it->info.file_data_offset << ' ' << it->info.file_size << ' '
+            << it->modified << ' ' << it->hash << ' ' << (it->buffer ? "<memory>" : it->source.string()) << '\n';
+    }
+    out.close();
+}
 
-	}
-    emit increaseProgress(1); //74
-    out->close();
+bool WKConverter::markChangedPayloads(DrsManifest &manifest, DrsManifest const &previous) {
+    /*
+     * Compares the payloads of a drs about to be written with the manifest of the existing one.
+     * Returns false if the layout is different (other base, ids, offsets or sizes), then the drs has to be rebuilt.
+     * Otherwise, only payloads with changed content stay marked as dirty. Files that were touched
+     * but have the same size are hashed, so that e.g. a reinstalled mod folder doesn't trigger any writes.
+     */
+    if (manifest.base != previous.base || manifest.payloads.size() != previous.payloads.size())
+        return false;
+    for (size_t i = 0; i < manifest.payloads.size(); i++) {
+        wololo::DrsFileInfo const &info = manifest.payloads[i].info;
+        wololo::DrsFileInfo const &oldInfo = previous.payloads[i].info;
+        if (manifest.payloads[i].table != previous.payloads[i].table || info.file_id != oldInfo.file_id
+                || info.file_data_offset != oldInfo.file_data_offset || info.file_size != oldInfo.file_size)
+            return false;
+    }
+    for (size_t i = 0; i < manifest.payloads.size(); i++) {
+        DrsPayload &payload = manifest.payloads[i];
+        DrsPayload const &old = previous.payloads[i];
+        if (!payload.hash.empty()) {
+            // already hashed while looking for shared content
+        } else if (!payload.buffer && payload.source == old.source && payload.modified == old.modified) {
+            payload.hash = old.hash;
+        } else {
+            payload.hash = hashDrsSource(payload);
+        }
+        payload.dirty = !payload.shared && payload.hash != old.hash;
+    }
+    return true;
+}
+
+void WKConverter::shareDrsPayloads(std::vector<DrsPayload> &payloads, DrsManifest const &previous) {
+    /*
+     * Finds payloads with the same content as an earlier one and marks them as shared with it,
+     * those are not written themselves but use the offset of the earlier payload.
+     * Only payloads whose size occurs more than once are compared. Several ids pointing to the same source
+     * file are equal without reading anything, other candidates are hashed, reusing the hash from the
+     * previous manifest if the source file didn't change since then.
+     */
+    std::map<fs::path, std::pair<std::time_t, std::string>> knownHashes;
+    for (std::vector<DrsPayload>::const_iterator it = previous.payloads.begin(); it != previous.payloads.end(); it++)
+        knownHashes[it->source] = std::make_pair(it->modified, it->hash);
+
+    std::map<int32_t, std::vector<size_t>> sameSize;
+    for (size_t i = 0; i < payloads.size(); i++)
+        sameSize[payloads[i].info.file_size].push_back(i);
+
+    for (std::map<int32_t, std::vector<size_t>>::iterator group = sameSize.begin(); group != sameSize.end(); group++) {
+        std::vector<size_t> const &candidates = group->second;
+        if (candidates.size() < 2)
+            continue;
+        bool sameSource = std::all_of(candidates.begin(), candidates.end(), [&](size_t i) {
+            return payloads[i].source == payloads[candidates[0]].source && payloads[i].buffer == payloads[candidates[0]].buffer;
+        });
+        std::map<std::string, size_t> firstWithContent;
+        for (std::vector<size_t>::const_iterator it = candidates.begin(); it != candidates.end(); it++) {
+            DrsPayload &payload = payloads[*it];
+            std::string content = payload.source.string();
+            if (!sameSource && payload.buffer) {
+                payload.hash = content = hashDrsSource(payload);
+            } else if (!sameSource) {
+                std::map<fs::path, std::pair<std::time_t, std::string>>::iterator known = knownHashes.find(payload.source);
+                if (known == knownHashes.end() || known->second.first != payload.modified || known->second.second.empty())
+                    knownHashes[payload.source] = std::make_pair(payload.modified, hashDrsSource(payload));
+                payload.hash = content = knownHashes[payload.source].second;
+            }
+            std::map<std::string, size_t>::iterator first = firstWithContent.find(content);
+            if (first == firstWithContent.end()) {
+                firstWithContent[content] = *it;
+            } else {
+                payload.shared = true;
+                payload.sharedWith = first->second;
+                payload.dirty = false;
+            }
+        }
+    }
 }
 
 /** A method to add extra (slp) files to an already existing drs file.
- *  Reads the old files, changes the offsets where necessary and writes back to a new file with changed offsets and the new files
- *  in: The stream of the old drs file
- *  out: The stream of the new drs file
+ *  The old drs is cloned and the new files are appended at its end. Only the directory at the start of the file
+ *  (header, table infos and file infos) is rewritten, so the cost depends on the number of new files, not the size of the drs.
+ *  oldDrsPath: The old drs file
+ *  newDrsPath: The new drs file
  */
-void WKConverter::editDrs(std::ifstream *in, std::ofstream *out) {
+void WKConverter::editDrs(fs::path const &oldDrsPath, fs::path const &newDrsPath) {
 
     int numberOfSlpFiles = slpFiles.size(); //These are the new files to be added to the drs
 
+    /*
+     * The offsets of the new files follow from the old drs, so they aren't part of the manifest here.
+     * If neither the old drs nor any of the new files changed, the new drs can be kept as it is.
+     */
+    DrsManifest manifest;
+    manifest.base = std::to_string(fs::file_size(oldDrsPath)) + " " + std::to_string(fs::last_write_time(oldDrsPath)) + " " + oldDrsPath.string();
+    for (AssetIndex::const_iterator it = slpFiles.begin(); it != slpFiles.end(); it++) {
+        wololo::DrsFileInfo slp = {it->id, 0, (int32_t) it->size};
+        manifest.payloads.push_back({0, it->path, it->buffer, slp, it->modified, "", true, false, 0});
+    }
+    DrsManifest previous;
+    if (loadDrsManifest(newDrsPath, previous) && markChangedPayloads(manifest, previous)
+            && std::none_of(manifest.payloads.begin(), manifest.payloads.end(), [](DrsPayload const &payload) { return payload.dirty; })) {
+        emit log("DRS unchanged");
+        emit increaseProgress(12); //33
+        return;
+    }
+    fs::remove(drsManifestPath(newDrsPath));
+    if (fs::is_symlink(newDrsPath))
+        fs::remove(newDrsPath); // don't write through a link to the old drs
 
     emit log(QString("number of files")+QString().setNum(numberOfSlpFiles));
     emit setInfo("working$\n$workingDrs2");
-
-    char * buffer;
-    char * intBuffer = new char[4];
     emit increaseProgress(1); //22
 
-
-    emit log("write header");
-    // header, no changes here
-    int length = sizeof (wololo::DrsHeader::copyright) + sizeof (wololo::DrsHeader::version) + sizeof (wololo::DrsHeader::ftype)
-            +sizeof (wololo::DrsHeader::table_count);
-    buffer = new char[length];
-    in->read(buffer,length);
-    emit log(QString(buffer));
-    out->write(buffer, length);
-    emit increaseProgress(1); //23
-
-    //There are extra file infos added, so the offset of the first file changes
-    int extraOffset = sizeof (wololo::DrsFileInfo) * (numberOfSlpFiles);
-    in->read(intBuffer,4);
-    int offsetOfFirstFile = *(reinterpret_cast<int *>(intBuffer));
-    offsetOfFirstFile += extraOffset;
-    out->write(reinterpret_cast<const char *>(&offsetOfFirstFile), sizeof (wololo::DrsHeader::file_offset));
-    emit increaseProgress(1); //24
-
-    emit log("slp table info");
-    //slp table info
-    length = sizeof (wololo::DrsTableInfo::file_type) + sizeof (wololo::DrsTableInfo::file_extension) + sizeof (wololo::DrsTableInfo::file_info_offset);
-    buffer = new char[length];
-    in->read(buffer,length);
-    out->write(buffer, length);
-    in->read(intBuffer,4);
-    int numberOfOldSlpFiles = *(reinterpret_cast<int *>(intBuffer));
-    emit log(intBuffer);
-    emit log(QString().setNum(numberOfOldSlpFiles));
-    int totalSlpFiles = numberOfOldSlpFiles+numberOfSlpFiles;
-    out->write(reinterpret_cast<const char *>(&totalSlpFiles), sizeof (wololo::DrsTableInfo::num_files));
-    emit increaseProgress(1); //25
-
-    emit log("wav table info");
-    length = sizeof (wololo::DrsTableInfo::file_type) + sizeof (wololo::DrsTableInfo::file_extension);
-    buffer = new char[length];
-    in->read(buffer,length);
-    out->write(buffer, length);
-    in->read(intBuffer,4);
-    emit log(intBuffer);
-    int wavInfoOffset = *(reinterpret_cast<int *>(intBuffer)) + extraOffset;
-    out->write(reinterpret_cast<const char *>(&wavInfoOffset), sizeof (wololo::DrsTableInfo::file_info_offset));
-    in->read(intBuffer,4);
-    emit log(intBuffer);
-    int numberOfOldWavFiles = *(reinterpret_cast<int *>(intBuffer));
-    emit log(QString().setNum(numberOfOldWavFiles));
-    out->write(reinterpret_cast<const char *>(&numberOfOldWavFiles), sizeof (wololo::DrsTableInfo::num_files));
-    emit increaseProgress(1); //26
-
-
-    // file infos
-    int fileOffset = 0;
-    int fileSize = 0;
-    int slpBlockSize = 0;
-    int wavBlockSize = 0;
-
-    emit log("old slp file infos");
-    for (int i = 0; i < numberOfOldSlpFiles; i++) {
-        in->read(intBuffer,4);
-        int fileId = *(reinterpret_cast<int *>(intBuffer));
-        if(fileId >= 60000 && (fileId <= 60138 || (fileId >= 70000 && fileId <= 70138) || (fileId >= 80000 && fileId <= 80017))) {
-            //First if is just a cheaper hardcoded precheck, can be removed if the function needs to be more general
-            if(slpFiles.count(fileId) > 0) {
-                fileId += 900000; //Doesn't really matter, just a large number that the game will never read
+    /*
+     * The OS copy can clone the file without copying any data on file systems that support it (e.g. ReFS block cloning)
+     */
+    emit log("clone old drs");
+    fs::copy_file(oldDrsPath, newDrsPath, fs::copy_option::overwrite_if_exists);
+    uintmax_t oldSize = fs::file_size(newDrsPath);
+    emit increaseProgress(3); //25
+
+    emit log("read old directory");
+    wololo::DrsView oldDrs(oldDrsPath);
+    wololo::DrsWriter writer(oldDrs.header());
+    int slpTable = oldDrs.findTable("slp");
+    if (slpTable < 0)
+        throw std::runtime_error("No slp table in "+oldDrsPath.string());
+    for (size_t i = 0; i < oldDrs.tableCount(); i++) {
+        writer.addTable(oldDrs.table(i));
+        bool isSlpTable = (int) i == slpTable;
+        std::vector<wololo::DrsFileInfo> const &files = oldDrs.files(i);
+        for (std::vector<wololo::DrsFileInfo>::const_iterator it = files.begin(); it != files.end(); it++) {
+            if (!oldDrs.contains(*it))
+                throw std::runtime_error("Broken drs, entry "+std::to_string(it->file_id)+" is outside of the file: "+oldDrsPath.string());
+            wololo::DrsFileInfo info = *it;
+            /*
+             * The game reads the first entry listed for an id, so an old file that is replaced
+             * has to get out of the way of the new one appended behind it
+             */
+            if(isSlpTable && slpFiles.count(info.file_id) > 0) {
+                info.file_id += 900000; //Doesn't really matter, just a large number that the game will never read
             }
+            writer.addPlacedFile(i, info);
         }
-        in->read(intBuffer,4);
-        fileOffset = *(reinterpret_cast<int *>(intBuffer))+extraOffset;
-        in->read(intBuffer,4);
-        fileSize = *(reinterpret_cast<int *>(intBuffer));
-        slpBlockSize += fileSize;
-        out->write(reinterpret_cast<const char *>(&fileId), sizeof (wololo::DrsFileInfo::file_id));
-        out->write(reinterpret_cast<const char *>(&fileOffset), sizeof (wololo::DrsFileInfo::file_data_offset));
-        out->write(reinterpret_cast<const char *>(&fileSize), sizeof (wololo::DrsFileInfo::file_size));
-
     }
-    emit increaseProgress(1); //27
-    int offset = fileOffset + fileSize;
-
-    emit log("new slp file infos");
-
-    std::vector<wololo::DrsFileInfo> slpFileInfos;
-
-    for (std::map<int,fs::path>::iterator it = slpFiles.begin(); it != slpFiles.end(); it++) {
-        wololo::DrsFileInfo slp;
-        size_t size;
-        size = fs::file_size(it->second);
-        slp.file_id = it->first;
-        slp.file_data_offset = offset;
-        slp.file_size = size;
-        offset += size;
-        slpFileInfos.push_back(slp);
+    size_t numberOfOldFiles = writer.fileCount();
+    std::vector<DrsPayload> payloads = manifest.payloads;
+    for (std::vector<DrsPayload>::iterator it = payloads.begin(); it != payloads.end(); it++)
+        writer.addFile(slpTable, it->info.file_id, it->info.file_size);
+    emit increaseProgress(2); //27
 
+    /*
+     * The directory grows by one file info per new file. Payloads at the start of the data section that are
+     * in the way are moved to the end of the file, everything else stays where it is.
+     */
+    emit log("make room for new file infos");
+    int32_t directoryEnd = writer.directorySize();
+    std::map<int32_t,int32_t> movedPayloadSizes; // old offset -> size, several file infos may share a payload
+    for (size_t i = 0; i < numberOfOldFiles; i++) {
+        wololo::DrsFileInfo const &info = writer.file(i);
+        if (info.file_data_offset < directoryEnd)
+            movedPayloadSizes[info.file_data_offset] = std::max(movedPayloadSizes[info.file_data_offset], info.file_size);
     }
-    emit increaseProgress(1);//28
-
-    for (std::vector<wololo::DrsFileInfo>::iterator it = slpFileInfos.begin(); it != slpFileInfos.end(); it++) {
-        out->write(reinterpret_cast<const char *>(&it->file_id), sizeof (wololo::DrsFileInfo::file_id));
-        out->write(reinterpret_cast<const char *>(&it->file_data_offset), sizeof (wololo::DrsFileInfo::file_data_offset));
-        out->write(reinterpret_cast<const char *>(&it->file_size), sizeof (wololo::DrsFileInfo::file_size));
+    uintmax_t newSize = std::max<uintmax_t>(oldSize, directoryEnd); // a tiny drs may end before the new directory does
+    std::map<int32_t,int32_t> movedPayloadOffsets; // old offset -> new offset
+    for (std::map<int32_t,int32_t>::iterator it = movedPayloadSizes.begin(); it != movedPayloadSizes.end(); it++) {
+        movedPayloadOffsets[it->first] = newSize;
+        newSize += it->second;
     }
-    emit increaseProgress(1);//29
-
-    emit log("wav file infos");
-    for (int i = 0; i < numberOfOldWavFiles; i++) {
-        in->read(intBuffer,4);
-        int fileId = *(reinterpret_cast<int *>(intBuffer));
-        in->read(intBuffer,4); //Old offset, not relevant anymore
-        in->read(intBuffer,4);
-        fileSize = *(reinterpret_cast<int *>(intBuffer));
-        wavBlockSize += fileSize;
-        out->write(reinterpret_cast<const char *>(&fileId), sizeof (wololo::DrsFileInfo::file_id));
-        out->write(reinterpret_cast<const char *>(&offset), sizeof (wololo::DrsFileInfo::file_data_offset));
-        out->write(reinterpret_cast<const char *>(&fileSize), sizeof (wololo::DrsFileInfo::file_size));
-        offset += fileSize;
-
+    newSize = writer.layout(newSize);
+    for (size_t i = 0; i < payloads.size(); i++)
+        payloads[i].info = writer.file(numberOfOldFiles + i);
+
+    fs::resize_file(newDrsPath, newSize);
+    wololo::FileDrsSink sink(newDrsPath.string());
+    for (std::map<int32_t,int32_t>::iterator it = movedPayloadOffsets.begin(); it != movedPayloadOffsets.end(); it++) {
+        wololo::DrsFileInfo moved = {0, it->first, movedPayloadSizes[it->first]};
+        wololo::DrsView::Payload const payload = oldDrs.payload(moved);
+        sink.write(it->second, payload.data(), payload.size());
     }
-    emit increaseProgress(1);//30
-
-
-    emit log("old slp files");
-    int bufferSize = 4096;
-    buffer = new char[bufferSize];
-    int i;
-    for(i = bufferSize; i < slpBlockSize; i+=bufferSize) {
-        in->read(buffer, bufferSize);
-        out->write(buffer, bufferSize);
-
+    for (size_t i = 0; i < numberOfOldFiles; i++) {
+        wololo::DrsFileInfo &info = writer.file(i);
+        if (movedPayloadOffsets.count(info.file_data_offset))
+            info.file_data_offset = movedPayloadOffsets[info.file_data_offset];
     }
-    length = slpBlockSize - i + bufferSize;
-    in->read(buffer,length);
-    out->write(buffer, length);
-    emit increaseProgress(1);//31
+    emit increaseProgress(2); //29
     emit setInfo("working$\n$workingDrs3");
 
-
     emit log("new slp files");
-    for (std::map<int,fs::path>::iterator it = slpFiles.begin(); it != slpFiles.end();it++) {
-            std::ifstream srcStream = std::ifstream(it->second.string(), std::ios::binary);
-            *out << srcStream.rdbuf();
-            srcStream.close();
+    writeDrsPayloads(sink, payloads);
+    for (size_t i = 0; i < payloads.size(); i++) {
+        manifest.payloads[i].hash = payloads[i].hash;
+    }
+    emit increaseProgress(3); //32
 
+    emit log("write directory");
+    writer.writeDirectory(sink);
+    emit increaseProgress(1);//33
+
+    if (settings->verifyDrs)
+        verifyDrs(newDrsPath, payloads);
+    if (settings->compactDrs) { // off by default, it copies every payload again while editing only wrote the new ones
+        emit log("compact drs");
+        compactDrs(newDrsPath);
     }
-    emit increaseProgress(1);//32
+    saveDrsManifest(newDrsPath, manifest);
+}
 
+void WKConverter::compactDrs(fs::path const &drsPath) {
+    /*
+     * Rewrites a drs without the entries nobody can read anymore: ids listed more than once in a table
+     * only keep their first entry, the one the game finds (see DrsView::find), and entries editDrs moved
+     * out of the way (id + 900000) are dropped if the original id is there. The remaining payloads are packed right after the directory,
+     * payloads shared by several entries stay shared, and any unused space in between disappears.
+     */
+    fs::path compactPath = drsPath.string()+".compact";
+    uintmax_t oldSize;
+    {
+        wololo::DrsView drs(drsPath);
+        oldSize = drs.size();
+        std::vector<std::vector<wololo::DrsFileInfo>> fileInfos(drs.tableCount());
+        size_t numberOfFileInfos = 0;
+        for (size_t i = 0; i < drs.tableCount(); i++) {
+            std::vector<wololo::DrsFileInfo> const &listed = drs.files(i);
+            std::set<int32_t> ids;
+            for (size_t j = 0; j < listed.size(); j++)
+                ids.insert(listed[j].file_id);
+            std::set<int32_t> kept;
+            for (size_t j = 0; j < listed.size(); j++) {
+                int32_t fileId = listed[j].file_id;
+                if (!kept.insert(fileId).second || (fileId >= 900000 && ids.count(fileId - 900000)))
+                    continue;
+                fileInfos[i].push_back(listed[j]);
+            }
+            numberOfFileInfos += fileInfos[i].size();
+        }
 
-    emit log("old wav files");
-    buffer = new char[bufferSize];
-    for(i = bufferSize; i < wavBlockSize; i+=bufferSize) {
-        in->read(buffer, bufferSize);
-        out->write(buffer, bufferSize);
+        wololo::DrsWriter writer(drs.header());
+        std::map<std::pair<int32_t,int32_t>,size_t> firstUse; // old offset and size -> file that got that payload first
+        for (size_t i = 0; i < fileInfos.size(); i++) {
+            writer.addTable(drs.table(i));
+            for (std::vector<wololo::DrsFileInfo>::iterator it = fileInfos[i].begin(); it != fileInfos[i].end(); it++) {
+                if (!drs.contains(*it))
+                    throw std::runtime_error("Broken drs, entry "+std::to_string(it->file_id)+" is outside of the file: "+drsPath.string());
+                std::pair<int32_t,int32_t> payload(it->file_data_offset, it->file_size);
+                if (firstUse.count(payload)) {
+                    writer.addSharedFile(i, it->file_id, firstUse[payload]);
+                } else {
+                    firstUse[payload] = writer.addFile(i, it->file_id, it->file_size);
+                }
+            }
+        }
+        uintmax_t newSize = writer.layout();
+        if (newSize == drs.size() && numberOfFileInfos == (size_t) (drs.header().file_offset - sizeof (wololo::DrsHeader)
+                - sizeof (wololo::DrsTableInfo) * drs.tableCount()) / sizeof (wololo::DrsFileInfo))
+            return; // nothing to drop
+
+        std::ofstream(compactPath.string(), std::ios::binary | std::ios::trunc).close();
+        fs::resize_file(compactPath, newSize);
+        wololo::FileDrsSink sink(compactPath.string());
+        writer.writeDirectory(sink);
+        for (std::map<std::pair<int32_t,int32_t>,size_t>::iterator it = firstUse.begin(); it != firstUse.end(); it++) {
+            wololo::DrsFileInfo old = {0, it->first.first, it->first.second};
+            wololo::DrsView::Payload const payload = drs.payload(old);
+            sink.write(writer.file(it->second).file_data_offset, payload.data(), payload.size());
+        }
+    }
+    /*
+     * The compacted drs replaces the one that was verified, so it gets the same directory checks before it does.
+     * If it's broken, the uncompacted drs is kept, it's bigger but works just as well.
+     */
+    try {
+        verifyDrsDirectory(wololo::DrsView(compactPath), compactPath);
+    } catch (std::exception const &e) {
+        fs::remove(compactPath);
+        emit log(QString("not compacting the drs: ")+e.what());
+        return;
+    }
+    fs::rename(compactPath, drsPath);
+    emit log(QString("compacted drs by ")+QString().setNum(oldSize - fs::file_size(drsPath))+" bytes");
+}
 
+void WKConverter::verifyDrs(fs::path const &drsPath, std::vector<DrsPayload> const &payloads) {
+    /*
+     * Reads back a drs that was just written and throws if it's broken, instead of leaving that to the game.
+     * After checking the directory (see verifyDrsDirectory), the entry the game finds for the id of every payload
+     * has to be the one the payload was written to, and every payload written by this run is read back
+     * and has to have the hash of its source.
+     * Payloads that weren't written (shared ones, and unchanged ones when patching) aren't read.
+     */
+    wololo::DrsView drs(drsPath);
+    verifyDrsDirectory(drs, drsPath);
+
+    int tables[] = {drs.findTable("slp"), drs.findTable("wav")};
+    for (std::vector<DrsPayload>::const_iterator it = payloads.begin(); it != payloads.end(); it++) {
+        int table = tables[it->table];
+        wololo::DrsFileInfo const *info = table < 0 ? nullptr : drs.find(table, it->info.file_id);
+        if (info == nullptr)
+            throw std::runtime_error("Broken drs, entry "+std::to_string(it->info.file_id)+" is missing: "+drsPath.string());
+        if (info->file_data_offset != it->info.file_data_offset || info->file_size != it->info.file_size)
+            throw std::runtime_error("Broken drs, entry "+std::to_string(it->info.file_id)+" doesn't point to "+it->source.string());
     }
-    length = wavBlockSize - i + bufferSize;
-    in->read(buffer,length);
-    out->write(buffer, length);
-    emit increaseProgress(1);//33
 
-    in->close();
-    out->close();
+    runDrsWorkers(payloads.size(), [&](size_t i) {
+        DrsPayload const &payload = payloads[i];
+        if (!payload.dirty)
+            return;
+        wololo::DrsView::Payload const written = drs.payload(payload.info);
+        if (hashDrsPayload(written.data(), written.size()) != payload.hash)
+            throw std::runtime_error("Broken drs, entry "+std::to_string(payload.info.file_id)+" doesn't match "
+                                     +(payload.buffer ? std::string("<memory>") : payload.source.string()));
+    });
+}
+
+void WKConverter::verifyDrsDirectory(wololo::DrsView const &drs, fs::path const &drsPath) {
+    /*
+     * Throws if the directory of a drs is broken. One pass over it checks that the tables follow the header,
+     * and that every entry lies inside the data section and doesn't overlap another one (entries sharing the same data are fine).
+     */
+    int32_t directoryEnd = sizeof (wololo::DrsHeader) + sizeof (wololo::DrsTableInfo) * drs.tableCount();
+    std::map<int32_t,int32_t> ranges; // offset -> size
+    for (size_t i = 0; i < drs.tableCount(); i++) {
+        wololo::DrsTableInfo const &table = drs.table(i);
+        if (table.file_info_offset != directoryEnd)
+            throw std::runtime_error("Broken drs, file list of table "+std::to_string(i)+" is misplaced: "+drsPath.string());
+        directoryEnd += sizeof (wololo::DrsFileInfo) * table.num_files;
+        std::vector<wololo::DrsFileInfo> const &files = drs.files(i);
+        for (std::vector<wololo::DrsFileInfo>::const_iterator info = files.begin(); info != files.end(); info++) {
+            if (!drs.contains(*info))
+                throw std::runtime_error("Broken drs, entry "+std::to_string(info->file_id)+" is outside of the file: "+drsPath.string());
+            if (info->file_size > 0)
+                ranges[info->file_data_offset] = std::max(ranges[info->file_data_offset], info->file_size);
+        }
+    }
+    if (drs.header().file_offset != directoryEnd)
+        throw std::runtime_error("Broken drs, wrong directory size: "+drsPath.string());
+    int32_t end = directoryEnd;
+    for (std::map<int32_t,int32_t>::iterator it = ranges.begin(); it != ranges.end(); it++) {
+        if (it->first < end)
+            throw std::runtime_error("Broken drs, entry at offset "+std::to_string(it->first)+" overlaps: "+drsPath.string());
+        end = it->first + it->second;
+    }
 }
 
 void WKConverter::copyCivIntroSounds(fs::path inputDir, fs::path outputDir) {
@@ -905,6 +1191,49 @@ void WKConverter::copyCivIntroSounds(fs::path inputDir, fs::path outputDir) {
 	}
 }
 
+std::string WKConverter::datSourceKey(std::vector<fs::path> const &inputs, std::string const &options) {
+    /*
+     * Identifies everything a generated dat was made from: the content of the input files and the options used.
+     * Bump the format tag whenever the way the dat is generated changes.
+     */
+    QCryptographicHash key(QCryptographicHash::Md5);
+    key.addData("wkdat1");
+    key.addData(options.c_str());
+    for (std::vector<fs::path>::const_iterator it = inputs.begin(); it != inputs.end(); it++) {
+        QFile input(QString::fromStdWString(it->wstring()));
+        if (!input.open(QIODevice::ReadOnly))
+            return ""; // can't tell, the dat needs to be generated
+        key.addData(&input);
+    }
+    return key.result().toHex().toStdString();
+}
+
+fs::path WKConverter::datSourcePath(fs::path const &datPath) {
+    return fs::path(datPath.string()+".source");
+}
+
+bool WKConverter::isDatUpToDate(fs::path const &datPath, std::string const &key) {
+    /*
+     * True if the dat was generated from the same sources by an earlier run and hasn't been touched since.
+     * Next to the dat, a file with the line "<key> <dat size> <dat mtime>" records that.
+     */
+    std::ifstream in(datSourcePath(datPath).string());
+    std::string oldKey;
+    uintmax_t size;
+    std::time_t modified;
+    if (key.empty() || !fs::exists(datPath) || fs::is_symlink(datPath) || !(in >> oldKey >> size >> modified))
+        return false;
+    return oldKey == key && size == fs::file_size(datPath) && modified == fs::last_write_time(datPath);
+}
+
+void WKConverter::saveDatSource(fs::path const &datPath, std::string const &key) {
+    if (key.empty())
+        return;
+    std::ofstream out(datSourcePath(datPath).string());
+    out << key << ' ' << fs::file_size(datPath) << ' ' << fs::last_write_time(datPath) << '\n';
+    out.close();
+}
+
 void WKConverter::uglyHudHack(fs::path assetsPath) {
 	/*
 	 * Shifts the offset between interface files by 10 so there's space for the new civs
@@ -912,7 +1241,7 @@ void WKConverter::uglyHudHack(fs::path assetsPath) {
 	int const hudFiles[] = {51130, 51160};
 	for (size_t baseIndex = 0; baseIndex < sizeof hudFiles / sizeof (int); baseIndex++) {
 		for (size_t i = 1; i <= 23; i++) {
-			slpFiles[hudFiles[baseIndex]+i+(baseIndex+1)*10] = assetsPath / (std::to_string(hudFiles[baseIndex]+i) + ".slp");
+			slpFiles.add(hudFiles[baseIndex]+i+(baseIndex+1)*10, hdSlpFiles.at(hudFiles[baseIndex]+i));
 		}
 	}
 
@@ -938,15 +1267,15 @@ void WKConverter::copyWallFiles(fs::path inputDir) {
 		if (archID < 0) {
             archID *= -1;
 			int digits = archID == 5 || archID == 7?124:324;
-            slpFiles[newBaseSLP+i*1000+324] = inputDir/(std::to_string(archID*1000+digits)+".slp");
-            slpFiles[newBaseSLP+i*1000+326] = inputDir/(std::to_string(archID*1000+digits+2)+".slp");
+            slpFiles.add(newBaseSLP+i*1000+324, slpFiles.at(archID*1000+digits));
+            slpFiles.add(newBaseSLP+i*1000+326, slpFiles.at(archID*1000+digits+2));
 			for (int j = 0; j <= 10; j+=2)
-                slpFiles[newBaseSLP+i*1000+345+j] = inputDir/(std::to_string(archID*1000+digits+21+j)+".slp");
+                slpFiles.add(newBaseSLP+i*1000+345+j, slpFiles.at(archID*1000+digits+21+j));
 		} else {
-			slpFiles[newBaseSLP+i*1000+324] = inputDir/(std::to_string(2098+archID)+".slp");
-			slpFiles[newBaseSLP+i*1000+326] = inputDir/(std::to_string(2110+archID)+".slp");
+			slpFiles.add(newBaseSLP+i*1000+324, slpFiles.at(2098+archID));
+			slpFiles.add(newBaseSLP+i*1000+326, slpFiles.at(2110+archID));
             for (int j = 0; j <= 10; j+=2)
-                slpFiles[newBaseSLP+i*1000+345+j] = inputDir/(std::to_string(4169+archID+j*2)+".slp");
+                slpFiles.add(newBaseSLP+i*1000+345+j, slpFiles.at(4169+archID+j*2));
 		}
 	}
 }
@@ -1217,16 +1546,19 @@ void WKConverter::createZRmap(std::map<std::string,fs::path>& terrainOverrides,
 }
 
 void WKConverter::transferHdDatElements(genie::DatFile *hdDat, genie::DatFile *aocDat) {
-
-	aocDat->Sounds = hdDat->Sounds;
-	aocDat->GraphicPointers = hdDat->GraphicPointers;
-	aocDat->Graphics = hdDat->Graphics;
-	aocDat->Techages = hdDat->Techages;
-	aocDat->UnitHeaders = hdDat->UnitHeaders;
-	aocDat->Civs = hdDat->Civs;
-	aocDat->Researchs = hdDat->Researchs;
-	aocDat->UnitLines = hdDat->UnitLines;
-	aocDat->TechTree = hdDat->TechTree;
+	/*
+	 * The HD dat isn't used for anything else afterwards, so its sections are moved instead of copied.
+	 * Only TerrainBlock and TerrainRestrictions are read from it after this, for the terrain swaps.
+	 */
+	aocDat->Sounds = std::move(hdDat->Sounds);
+	aocDat->GraphicPointers = std::move(hdDat->GraphicPointers);
+	aocDat->Graphics = std::move(hdDat->Graphics);
+	aocDat->Techages = std::move(hdDat->Techages);
+	aocDat->UnitHeaders = std::move(hdDat->UnitHeaders);
+	aocDat->Civs = std::move(hdDat->Civs);
+	aocDat->Researchs = std::move(hdDat->Researchs);
+	aocDat->UnitLines = std::move(hdDat->UnitLines);
+	aocDat->TechTree = std::move(hdDat->TechTree);
     aocDat->TerrainRestrictions.push_back(aocDat->TerrainRestrictions[14]);
     aocDat->TerrainRestrictionPointers1.push_back(1);
     aocDat->TerrainRestrictionPointers2.push_back(1);
@@ -1258,8 +1590,8 @@ void WKConverter::transferHdDatElements(genie::DatFile *hdDat, genie::DatFile *a
     };
 
     for(std::map<int,std::string>::iterator iter = newTerrainSlps.begin(); iter != newTerrainSlps.end(); iter++) {
-        if(slpFiles[iter->first].empty())
-            slpFiles[iter->first] = newTerrainFiles[iter->second];
+        if(!slpFiles.count(iter->first))
+            slpFiles.add(iter->first, newTerrainFiles[iter->second]);
     }
 
 	aocDat->TerrainBlock.Terrains[35].TerrainToDraw = -1;
@@ -1405,7 +1737,7 @@ void WKConverter::patchArchitectures(genie::DatFile *aocDat) {
 			newGraphic.SLP = newSLP;
 			aocDat->Graphics.push_back(newGraphic);
 			aocDat->GraphicPointers.push_back(1);
-            slpFiles[newSLP] = settings->HDPath/("resources\\_common\\drs\\graphics\\776.slp");
+            slpFiles.add(newSLP, aocSlpFiles.at(776));
 		} else {
 			monkHealingGraphic = 7340; //meso healing graphic
 		}
@@ -1468,8 +1800,8 @@ void WKConverter::patchArchitectures(genie::DatFile *aocDat) {
     //Fix the missionary converting frames while we're at it
     aocDat->Graphics[6616].FrameCount = 14;
     //Manual fix for missing portugese flags
-    slpFiles[41178] = settings->HDPath/("resources\\_common\\drs\\graphics\\4522.slp");
-    slpFiles[41181] = settings->HDPath/("resources\\_common\\drs\\graphics\\4523.slp");
+    slpFiles.add(41178, aocSlpFiles.at(4522));
+    slpFiles.add(41181, aocSlpFiles.at(4523));
 
 }
 
@@ -1557,14 +1889,11 @@ short WKConverter::duplicateGraphic(genie::DatFile *aocDat, std::map<short,short
     newGraphic.ID = newGraphicID;
     if(newSLP > 0 && newSLP != aocDat->Graphics[graphicID].SLP && newSLP != aocDat->Graphics[compareID].SLP) {
         // This is a graphic where we want a new SLP file (as opposed to one where the a new SLP mayb just be needed for some deltas
-        fs::path src = settings->HDPath/("resources\\_common\\drs\\gamedata_x2\\"+std::to_string(newGraphic.SLP)+".slp");
-		if(fs::exists(src))
-			slpFiles[newSLP] = src;
-		else {
-            src = settings->HDPath/("resources\\_common\\drs\\graphics\\"+std::to_string(newGraphic.SLP)+".slp");
-			if(fs::exists(src))
-				slpFiles[newSLP] = src;
-		}        
+        // Prefer the HD version (gamedata_x2), otherwise use the one in graphics
+        if(Asset const *src = hdSlpFiles.find(newGraphic.SLP))
+            slpFiles.add(newSLP, *src);
+        else if(Asset const *src = aocSlpFiles.find(newGraphic.SLP))
+            slpFiles.add(newSLP, *src);
         newGraphic.SLP = newSLP;
 	}
     std::string civCode;
@@ -1813,7 +2142,7 @@ void WKConverter::hotkeySetup() {
 	}
 }
 
-void WKConverter::symlinkSetup(fs::path oldDir, fs::path newDir, fs::path xmlIn, fs::path xmlOut, bool dataMod) {
+void WKConverter::symlinkSetup(fs::path oldDir, fs::path newDir, fs::path xmlIn, fs::path xmlOut, bool dataMod, bool ownDrs) {
 
     /* Sets up symlinks between the different mod versions (offline/AK/FE), so as much as possible is shared
      * and as little space is needed as possible
@@ -1823,6 +2152,8 @@ void WKConverter::symlinkSetup(fs::path oldDir, fs::path newDir, fs::path xmlIn,
      * xmlIn: The connected xml of the source folder
      * xmlOut: The connected xml of the destination folder
      * dataMod: If true, the symlink is for wk-based datamod
+     * ownDrs: If true, gamedata_x1_p1.drs isn't linked, editDrs writes one for this folder.
+     *          One left from an earlier install is kept, so editDrs can tell whether it's still up to date.
      */
     std::string newDirString = newDir.string()+"\\";
     std::string oldDirString = oldDir.string()+"\\";
@@ -1838,7 +2169,10 @@ void WKConverter::symlinkSetup(fs::path oldDir, fs::path newDir, fs::path xmlIn,
     } else {
         fs::create_directory(newDir/"Data");
         fs::remove(newDir/"Data\\gamedata_x1.drs");
-        fs::remove(newDir/"Data\\gamedata_x1_p1.drs");
+        if (!ownDrs || fs::is_symlink(newDir/"Data\\gamedata_x1_p1.drs")) {
+            fs::remove(newDir/"Data\\gamedata_x1_p1.drs");
+            fs::remove(drsManifestPath(newDir/"Data\\gamedata_x1_p1.drs"));
+        }
     }
 
 	fs::remove_all(newDir/"Taunt");
@@ -1864,8 +2198,9 @@ void WKConverter::symlinkSetup(fs::path oldDir, fs::path newDir, fs::path xmlIn,
         }
     }
 	std::string datastring = datalink?"mklink /D \""+newDirString+"Data\" \""+ oldDirString+"Data\" & ":
-                                      "mklink \""+newDirString+"Data\\gamedata_x1_p1.drs\" \""+ oldDirString+"Data\\gamedata_x1_p1.drs\" & "
                                       "mklink \""+newDirString+"Data\\gamedata_x1.drs\" \""+ oldDirString+"Data\\gamedata_x1.drs\" & ";
+    if(!datalink && !ownDrs)
+        datastring += "mklink \""+newDirString+"Data\\gamedata_x1_p1.drs\" \""+ oldDirString+"Data\\gamedata_x1_p1.drs\" & ";
     std::string languageString = "";
 
     if(!dataMod) {
@@ -1974,7 +2309,26 @@ void WKConverter::setupFolders(fs::path xmlOutPathUP) {
     }
 
     emit log("Removing base folders");
-    fs::remove_all(installDir/"Data");
+    /*
+     * gamedata_x1_p1.drs and its manifest stay, makeDrs only rewrites what changed since the last install.
+     * A drs that is only a link to another install is removed like everything else.
+     */
+    fs::path dataDir = installDir/"Data";
+    if (fs::is_symlink(dataDir) || !fs::is_directory(dataDir)) {
+        fs::remove_all(dataDir);
+    } else {
+        fs::path drsPath = dataDir/"gamedata_x1_p1.drs";
+        bool keepDrs = !fs::is_symlink(drsPath);
+        std::vector<fs::path> oldFiles;
+        for (fs::directory_iterator current(dataDir), end;current != end; ++current) {
+            std::string filename = tolower(current->path().filename().string());
+            if (keepDrs && (filename == "gamedata_x1_p1.drs" || filename == drsManifestPath("gamedata_x1_p1.drs").string()))
+                continue;
+            oldFiles.push_back(current->path());
+        }
+        for (std::vector<fs::path>::iterator it = oldFiles.begin(); it != oldFiles.end(); it++)
+            fs::remove_all(*it);
+    }
     /*
     fs::remove_all(installDir/"Script.Ai\\Brutal2");
     fs::remove(installDir/"Script.Ai\\BruteForce3.1.ai");
@@ -2000,7 +2354,8 @@ void WKConverter::setupFolders(fs::path xmlOutPathUP) {
         fs::remove(xmlOutPathUP);
         fs::remove(settings->upDir/"Data\\empires2_x1_p1.dat");
         fs::remove(settings->upDir/"Data\\gamedata_x1.drs");
-        fs::remove(settings->upDir/"Data\\gamedata_x1_p1.drs");
+        if (fs::is_symlink(settings->upDir/"Data\\gamedata_x1_p1.drs"))
+            fs::remove(settings->upDir/"Data\\gamedata_x1_p1.drs"); // otherwise it's the drs of this install, kept for makeDrs
         /*
         fs::remove_all(settings->upDir/"Script.Ai\\Brutal2");
         fs::remove(settings->upDir/"Script.Ai\\BruteForce3.1.ai");
@@ -2023,7 +2378,10 @@ int WKConverter::run(bool retry)
 	int ret = 0;
 	slpFiles.clear();
 	wavFiles.clear();
+	aocSlpFiles.clear();
+	hdSlpFiles.clear();
 	newTerrainFiles.clear();
+	drsFileScans.clear();
 
 
     try {
@@ -2144,8 +2502,34 @@ int WKConverter::run(bool retry)
         emit increaseProgress(1); //6
 
         if (settings->patch < 0) {
+            /*
+             * Start walking all the directories that will be indexed during this run.
+             * They are merged where they were indexed before, in the same order.
+             */
+            prefetchDrsFiles(assetsPath);
+            prefetchDrsFiles(aocAssetsPath);
+            if(settings->usePw)
+                prefetchDrsFiles(pwInputDir);
+            if(settings->useGrid) {
+                prefetchDrsFiles(gridInputDir);
+                prefetchDrsFiles(newGridTerrainInputDir, true);
+                if(settings->useNoSnow)
+                    prefetchDrsFiles(gridNoSnowInputDir);
+            } else {
+                prefetchDrsFiles(newTerrainInputDir, true);
+                if(settings->useNoSnow)
+                    prefetchDrsFiles(noSnowInputDir);
+            }
+            prefetchDrsFiles(terrainOverrideDir, true);
+            if(settings->useWalls)
+                prefetchDrsFiles(wallsInputDir);
+            prefetchDrsFiles(settings->useMonks ? monkInputDir : oldMonkInputDir);
+            prefetchDrsFiles(architectureFixDir);
+            prefetchDrsFiles(modOverrideDir);
+
             emit log("index DRS files");
             indexDrsFiles(assetsPath); //Slp/wav files to be written into gamedata_x1_p1.drs
+            hdSlpFiles = slpFiles; //Nothing's overridden yet, keep the plain HD files for the architecture patching
             indexDrsFiles(aocAssetsPath, false); //Aoc slp files, just needed for comparison purposes
 
             emit log("Visual Mod Stuff");
@@ -2175,6 +2559,22 @@ int WKConverter::run(bool retry)
 
             emit setInfo("working$\n$workingFiles");
 
+            /*
+             * The dats don't depend on any of the files copied below, so they are loaded on another thread
+             * in the meantime. They are loaded one after the other on that thread, as genieutils
+             * keeps state like the default game version in statics. The future is declared after the dats,
+             * so leaving this block always waits for the loading to finish before the dats go away.
+             */
+            genie::DatFile aocDat;
+            std::unique_ptr<genie::DatFile> hdDat(new genie::DatFile()); // freed as soon as its elements are transferred
+            std::future<void> datLoad = std::async(std::launch::async, [&]() {
+                std::lock_guard<std::mutex> lock(datLoadMutex);
+                aocDat.setGameVersion(genie::GameVersion::GV_TC);
+                aocDat.load(aocDatString.c_str());
+                hdDat->setGameVersion(genie::GameVersion::GV_Cysion);
+                hdDat->load(hdDatString.c_str());
+            });
+
             try {
                 emit log("History Files");
 
@@ -2350,17 +2750,11 @@ int WKConverter::run(bool retry)
 
 
 
-            genie::DatFile aocDat;
-            genie::DatFile hdDat;
             try {
-                aocDat.setGameVersion(genie::GameVersion::GV_TC);
-                aocDat.load(aocDatString.c_str());
+                datLoad.get();
                 emit increaseProgress(3); //28
 
                 emit setInfo("working$\n$workingHD");
-
-                hdDat.setGameVersion(genie::GameVersion::GV_Cysion);
-                hdDat.load(hdDatString.c_str());
                 emit increaseProgress(3); //31
 
                 emit setInfo("working$\n$workingInterface");
@@ -2374,7 +2768,8 @@ int WKConverter::run(bool retry)
 
 
                 emit log("Transfer HD Dat elements");
-                transferHdDatElements(&hdDat, &aocDat);
+                transferHdDatElements(hdDat.get(), &aocDat);
+                hdDat.reset();
                 emit increaseProgress(1); //33
 
                 emit log("Patch Architectures");
@@ -2429,9 +2824,8 @@ int WKConverter::run(bool retry)
                     indexDrsFiles(modOverrideDir);
                 emit increaseProgress(1); //66
                 emit log("Opening DRS");
-                std::ofstream drsOut(drsOutPath, std::ios::binary);
                 emit log("Make DRS");
-                makeDrs(&drsOut);
+                makeDrs(drsOutPath);
                 emit increaseProgress(1); //75
 
 
@@ -2571,13 +2965,34 @@ int WKConverter::run(bool retry)
         } else { //If we use a balance mod or old patch, just copy the supplied dat fil
             try {
                 emit log("Copy DAT file");
-                fs::remove(outputDatPath);
-                genie::DatFile dat;
-                dat.setGameVersion(genie::GameVersion::GV_TC);
-                dat.load(hdDatString.c_str());
+                /*
+                 * The patched dat only depends on the data mod's dat and the flag adjustments,
+                 * if neither changed since the last install the dat from back then is still right
+                 */
+                std::vector<fs::path> datInputs = {hdDatString};
                 if(settings->fixFlags)
-                    adjustArchitectureFlags(&dat,"resources\\WKFlags.txt");
-                dat.saveAs(outputDatPath.string().c_str());
+                    datInputs.push_back("resources\\WKFlags.txt");
+                std::string datKey = datSourceKey(datInputs, settings->fixFlags ? "fixFlags" : "");
+                if(isDatUpToDate(outputDatPath, datKey)) {
+                    emit log("Dat unchanged");
+                } else {
+                    fs::remove(datSourcePath(outputDatPath));
+                    fs::remove(outputDatPath);
+                    if(settings->fixFlags) {
+                        genie::DatFile dat;
+                        dat.setGameVersion(genie::GameVersion::GV_TC);
+                        dat.load(hdDatString.c_str());
+                        adjustArchitectureFlags(&dat,"resources\\WKFlags.txt");
+                        dat.saveAs(outputDatPath.string().c_str());
+                    } else {
+                        /*
+                         * Nothing to patch, the data mod's dat already is a compressed TC dat,
+                         * no need to parse and serialize it again
+                         */
+                        fs::copy_file(hdDatString, outputDatPath, fs::copy_option::overwrite_if_exists);
+                    }
+                    saveDatSource(outputDatPath, datKey);
+                }
                 emit setProgress(20);
                 std::string patchNumber = std::get<2>(settings->dataModList[settings->patch]);
                 std::ofstream versionOut(versionIniPath);
@@ -2618,21 +3033,20 @@ int WKConverter::run(bool retry)
                 out << str;
                 input.close();
                 out.close();
+                bool ownDrs = std::get<3>(settings->dataModList[settings->patch]) & 4; // the data mod adds slps to the drs
                 if(settings->useBoth || settings->useVoobly)
-                    symlinkSetup(settings->vooblyDir.parent_path() / (baseModName+dlcExtension), settings->vooblyDir,xmlIn,settings->vooblyDir/"age2_x1.xml",true);
+                    symlinkSetup(settings->vooblyDir.parent_path() / (baseModName+dlcExtension), settings->vooblyDir,xmlIn,settings->vooblyDir/"age2_x1.xml",true,ownDrs);
                     if(std::get<3>(settings->dataModList[settings->patch]) & 4) {
                         indexDrsFiles(slpCompatDir);
-                        std::ifstream oldDrs (settings->vooblyDir.parent_path().string() + "\\" + baseModName+dlcExtension+"\\data\\gamedata_x1_p1.drs", std::ios::binary);
-                        std::ofstream newDrs (settings->vooblyDir.string()+"\\data\\gamedata_x1_p1.drs", std::ios::binary);
-                        editDrs(&oldDrs, &newDrs);
+                        editDrs(settings->vooblyDir.parent_path().string() + "\\" + baseModName+dlcExtension+"\\data\\gamedata_x1_p1.drs",
+                                settings->vooblyDir.string()+"\\data\\gamedata_x1_p1.drs");
                     }
                 if(settings->useBoth || settings->useExe) {
-                    symlinkSetup(settings->upDir.parent_path() / (baseModName+dlcExtension), settings->upDir, xmlIn, settings->upDir.parent_path()/(UPModdedExe+".xml"), true);
+                    symlinkSetup(settings->upDir.parent_path() / (baseModName+dlcExtension), settings->upDir, xmlIn, settings->upDir.parent_path()/(UPModdedExe+".xml"), true, ownDrs);
                     if(std::get<3>(settings->dataModList[settings->patch]) & 4) {
                         indexDrsFiles(slpCompatDir);
-                        std::ifstream oldDrs (settings->upDir.parent_path().string() + "\\" + baseModName+dlcExtension+"\\data\\gamedata_x1_p1.drs", std::ios::binary);
-                        std::ofstream newDrs (settings->upDir.string()+"\\data\\gamedata_x1_p1.drs", std::ios::binary);
-                        editDrs(&oldDrs, &newDrs);
+                        editDrs(settings->upDir.parent_path().string() + "\\" + baseModName+dlcExtension+"\\data\\gamedata_x1_p1.drs",
+                                settings->upDir.string()+"\\data\\gamedata_x1_p1.drs");
                     }
                 }
                 fs::remove(xmlIn);
@@ -4,11 +4,18 @@
 #include <set>
 #include <regex>
 #include <map>
+#include <functional>
+#include <future>
+#include <mutex>
 #include <QObject>
 
 #include <boost/filesystem.hpp>
 #include "genie/dat/DatFile.h"
 #include "genie/lang/LangFile.h"
+#include "wololo/Drs.h"
+#include "wololo/DrsView.h"
+#include "wololo/DrsWriter.h"
+#include "assetindex.h"
 #include "wksettings.h"
 #include "wkgui.h"
 #include <QIODevice>
@@ -47,9 +54,10 @@ private:
 
     WKSettings* settings;
     std::set<char> civLetters;
-    std::set<int> aocSlpFiles;
-    std::map<int, fs::path> slpFiles;
-    std::map<int, fs::path> wavFiles;
+    AssetIndex aocSlpFiles;
+    AssetIndex hdSlpFiles;
+    AssetIndex slpFiles;
+    AssetIndex wavFiles;
     std::map<std::string,fs::path> newTerrainFiles;
     std::vector<std::pair<int,std::string>> rmsCodeStrings;
     bool secondAttempt = false;
@@ -63,6 +71,32 @@ private:
     std::string baseModName = "WololoKingdoms";
     fs::path resourceDir = fs::path("resources\\");
 
+    struct DrsPayload {
+        int table; // 0 slp, 1 wav
+        fs::path source;
+        AssetBuffer buffer; // if set, the content is taken from here instead of source
+        wololo::DrsFileInfo info;
+        std::time_t modified;
+        std::string hash;
+        bool dirty; // needs to be written
+        bool shared; // same content as payloads[sharedWith], stored only once at its offset
+        size_t sharedWith;
+    };
+
+    struct DrsManifest {
+        std::string base; // the drs an edited drs was created from, empty for a new one
+        std::vector<DrsPayload> payloads;
+    };
+
+    struct DrsFileScan {
+        std::vector<Asset> slps;
+        std::vector<Asset> wavs;
+        std::map<std::string,fs::path> terrains;
+    };
+
+    std::map<fs::path, std::future<DrsFileScan>> drsFileScans; // directories being scanned in the background
+    std::mutex datLoadMutex; // genieutils keeps state in statics, so only one thread may load dats at a time
+
     enum TerrainType {
         None,
         WaterTerrain,
@@ -83,6 +117,8 @@ private:
 	void terrainSwap(genie::DatFile *hdDat, genie::DatFile *aocDat, int tNew, int tOld, int slpID);
     void recCopy(fs::path const &src, fs::path const &dst, bool skip = false, bool force = false);
     void indexDrsFiles(fs::path const &src, bool expansionFiles = true, bool terrainFiles = false);
+    void prefetchDrsFiles(fs::path const &src, bool terrainFiles = false);
+    static DrsFileScan scanDrsFiles(fs::path const &src, bool terrainFiles);
     void copyHistoryFiles(fs::path inputDir, fs::path outputDir);
     std::pair<int,std::string> getTextLine(std::string line);
 	void convertLanguageFile(std::ifstream *in, std::ofstream *iniOut, genie::LangFile *dllOut, bool generateLangDll, std::map<int, std::string> *langReplacement);
@@ -91,8 +127,25 @@ private:
     void loadModdedStrings(std::string moddedStringsFile, std::map<int, std::string>& langReplacement);
     bool openLanguageDll(genie::LangFile *langDll, fs::path langDllPath, fs::path langDllFile);
     bool saveLanguageDll(genie::LangFile *langDll, fs::path langDllFile);
-	void makeDrs(std::ofstream *out);
-    void editDrs(std::ifstream *in, std::ofstream *out);
+	void makeDrs(fs::path const &drsOutPath);
+    std::string copyDrsPayload(DrsPayload const &payload, wololo::DrsSink &sink);
+    void writeDrsPayloads(wololo::DrsSink &sink, std::vector<DrsPayload> &payloads);
+    void runDrsWorkers(size_t count, std::function<void(size_t)> const &work);
+    std::string hashDrsPayload(char const *data, size_t size);
+    std::string hashDrsSource(DrsPayload const &payload);
+    fs::path drsManifestPath(fs::path const &drsPath);
+    bool loadDrsManifest(fs::path const &drsPath, DrsManifest &manifest);
+    void saveDrsManifest(fs::path const &drsPath, DrsManifest const &manifest);
+    bool markChangedPayloads(DrsManifest &manifest, DrsManifest const &previous);
+    void shareDrsPayloads(std::vector<DrsPayload> &payloads, DrsManifest const &previous);
+    void editDrs(fs::path const &oldDrsPath, fs::path const &newDrsPath);
+    void verifyDrs(fs::path const &drsPath, std::vector<DrsPayload> const &payloads);
+    void verifyDrsDirectory(wololo::DrsView const &drs, fs::path const &drsPath);
+    void compactDrs(fs::path const &drsPath);
+    std::string datSourceKey(std::vector<fs::path> const &inputs, std::string const &options);
+    fs::path datSourcePath(fs::path const &datPath);
+    bool isDatUpToDate(fs::path const &datPath, std::string const &key);
+    void saveDatSource(fs::path const &datPath, std::string const &key);
     void uglyHudHack(fs::path);
     void copyCivIntroSounds(fs::path inputDir, fs::path outputDir);
     void copyWallFiles(fs::path inputDir);
@@ -108,7 +161,7 @@ private:
     void copyHotkeyFile(fs::path maxHki, fs::path lastEditedHki, fs::path dst);
     void removeWkHotkeys();
 	void hotkeySetup();
-    void symlinkSetup(fs::path oldDir, fs::path newDir, fs::path xmlIn, fs::path xmlOut, bool dataMod = false);
+    void symlinkSetup(fs::path oldDir, fs::path newDir, fs::path xmlIn, fs::path xmlOut, bool dataMod = false, bool ownDrs = false);
     void setupFolders(fs::path xmlOutPathUP);
     void retryInstall();
     bool copyData(QIODevice &inFile, QIODevice &outFile);
@@ -47,6 +47,9 @@ public:
     fs::path nfzUpOutPath;
     std::map<int, std::tuple<std::string,std::string, std::string, int, std::string>> dataModList;
     std::string modName;
+    unsigned int drsWorkers = 0; //Threads writing the drs payloads, 0 means one per core
+    bool verifyDrs = true; //Check the directory of a newly written drs and read back every payload that was written
+    bool compactDrs = false; //Rewrite an edited drs without the entries it replaced, this copies the whole drs once more
 };
 
 #endif // WKSETTINGS_H